@@ -2,44 +2,756 @@
 #include <malloc.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <stdint.h>
+#ifdef DCC_THREADS
+#include <pthread.h>
+#include <sched.h>
+#endif
+#include "dcc.h"
 
 #define SZ(N) ((N)*sizeof(comp_t *))
-enum comp_type { ct_sc, ct_ref, ct_val, ct_alg };
-typedef struct comp_t {
-	 union { 
-		void (*sc)(struct comp_t** result, struct comp_t** args);
-		struct comp_t* ref;
-		double value;
-    unsigned tag;
-	 } val;
-	 int arity;
-	 int applied;
-	 enum comp_type type;
-   struct comp_t** args;
-} comp_t;
+/*
+ * Allocation.
+ * Nodes and args blocks are bump-allocated from 1MB chunks. An args block
+ * carries its capacity in a header word and is rounded up to a power-of-two
+ * size class; blocks dropped by eval() go on a free list per
+ * class and are handed out again before the chunk is bumped.
+ * Small blocks live inside their node instead (see node_args()).
+ * Build with -DDCC_NO_GC for a plain arena that is never collected, and
+ * with -DDCC_NO_LIBC_MALLOC to take chunks straight from mmap.
+ */
+#ifdef DCC_NO_LIBC_MALLOC
+#include <sys/mman.h>
+static void* sys_alloc(size_t bytes)
+{
+	void* p = mmap(NULL, bytes, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	return p == MAP_FAILED ? NULL : p;
+}
+static void sys_free(void* p, size_t bytes)
+{
+	munmap(p, bytes);
+}
+#else
+static void* sys_alloc(size_t bytes)
+{
+	return malloc(bytes);
+}
+static void sys_free(void* p, size_t bytes)
+{
+	free(p);
+}
+#endif
+#ifndef GC_HEAP_LIMIT
+#define GC_HEAP_LIMIT (256UL<<20)
+#endif
+#define GC_CHUNK (1UL<<20)
+#define GC_MIN_TRIGGER (4UL<<20)
+#define ARGS_CLASSES 32
+#define ARGS_INLINE 4 // a node with at most this many arguments holds them itself
+typedef struct chunk_t {
+	struct chunk_t* next;
+	size_t size, used;
+	size_t counted; // of used, what heap_since_gc already includes (threaded runtime)
+	char data[];
+} chunk_t;
+typedef struct args_t {
+	size_t cap;
+	comp_t* slot[]; // slot[0] links the free list while the block is free
+} args_t;
+#define ARGS_BLOCK(a) ((args_t*)((char*)(a) - sizeof(args_t)))
+static chunk_t *heap_head, *heap_tail, *heap_spare;
+static DCC_TLS chunk_t* alloc_chunk; // the chunk this thread allocates from
+static args_t* args_free[ARGS_CLASSES];
+#ifdef DCC_THREADS
+DCC_TLS comp_t*** gc_roots;
+#else
+comp_t** gc_roots[GC_ROOTS_MAX];
+#endif
+DCC_TLS int gc_nroots;
+static comp_t** static_roots;
+static int n_static_roots, max_static_roots;
+#ifndef EVAL_STACK_LIMIT
+#define EVAL_STACK_LIMIT (16UL<<20)
+#endif
+static DCC_TLS comp_t** eval_stack;
+static DCC_TLS size_t eval_sp, eval_max;
+static size_t eval_limit = EVAL_STACK_LIMIT;
+static size_t heap_limit = GC_HEAP_LIMIT, heap_since_gc, gc_trigger = GC_MIN_TRIGGER;
+#ifndef DCC_NO_GC
+static size_t heap_live;
+#endif
+static struct {
+	unsigned long collections;
+	size_t allocated, copied, max_live;
+	double seconds;
+	clock_t start;
+} gc_stats;
+#define REF_BUCKETS 6 // chains of 0, 1, 2, 3, 4-7 and 8 or more indirections
+typedef struct counters_t {
+	unsigned long allocs, reused;
+	unsigned long in_place, indirect; // how reduced nodes were updated
+	unsigned long chains[REF_BUCKETS];
+} counters_t;
+static DCC_TLS counters_t counters;
+#ifdef DCC_THREADS
+static DCC_TLS size_t thread_bytes; // heap_since_gc is shared and lags behind
+#endif
+void gc_fatal(const char* msg)
+{
+	fprintf(stderr, "dcc runtime: %s\n", msg);
+	exit(2);
+}
+#ifdef DCC_THREADS
+/*
+ * Threads. Every thread that evaluates has its own root stack,
+ * evaluation stack, allocation chunk and spark pool; the registry lets
+ * the collector find them all. A collection stops the world: the
+ * collecting thread raises gc_pending and waits until every other
+ * thread has parked at a safe point (see GC_SAFE_POINT) or is idle.
+ */
+#define THREADS_MAX 256
+#define SPARKS 4096
+#define SPIN_LOCK(l) while (__atomic_exchange_n(&(l), 1, __ATOMIC_ACQUIRE)) sched_yield()
+#define SPIN_UNLOCK(l) __atomic_store_n(&(l), 0, __ATOMIC_RELEASE)
+typedef struct spark_pool {
+	int lock;
+	unsigned top, bottom; // the sparks are spark[top..bottom), modulo SPARKS
+	comp_t* spark[SPARKS];
+} spark_pool;
+typedef struct thread_t {
+	comp_t*** roots;
+	int* nroots;
+	comp_t*** stack;
+	size_t* sp;
+	chunk_t** chunk;
+	spark_pool* sparks;
+	counters_t* stats;
+} thread_t;
+static thread_t threads[THREADS_MAX];
+static int n_threads, n_parked, n_idle, gc_pending, heap_lock;
+static unsigned long sparks_made, sparks_run;
+static DCC_TLS int self;
+static DCC_TLS spark_pool* my_sparks;
+static pthread_mutex_t rts_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rts_cond = PTHREAD_COND_INITIALIZER; // parking for collections
+static pthread_cond_t spark_cond = PTHREAD_COND_INITIALIZER; // idle workers
+#define HEAP_LOCK() SPIN_LOCK(heap_lock)
+#define HEAP_UNLOCK() SPIN_UNLOCK(heap_lock)
+static void thread_register(void)
+{
+	gc_roots = sys_alloc(GC_ROOTS_MAX*sizeof(comp_t**));
+	my_sparks = sys_alloc(sizeof(spark_pool));
+	if (!gc_roots || !my_sparks)
+		gc_fatal("out of memory");
+	memset(my_sparks, 0, sizeof(spark_pool));
+	pthread_mutex_lock(&rts_lock);
+	if (n_threads == THREADS_MAX)
+		gc_fatal("too many threads");
+	self = n_threads;
+	threads[self] = (thread_t){ gc_roots, &gc_nroots, &eval_stack, &eval_sp,
+		&alloc_chunk, my_sparks, &counters };
+	n_threads++;
+	pthread_cond_broadcast(&rts_cond);
+	pthread_mutex_unlock(&rts_lock);
+}
+// Wait at a safe point while a collection is on. An idle thread also
+// waits a little for sparks to turn up.
+static void rts_park(int idle)
+{
+	pthread_mutex_lock(&rts_lock);
+	n_parked++;
+	if (gc_pending)
+		pthread_cond_broadcast(&rts_cond);
+	if (idle && !gc_pending) {
+		struct timespec t;
+		clock_gettime(CLOCK_REALTIME, &t);
+		t.tv_nsec += 1000000;
+		if (t.tv_nsec >= 1000000000) {
+			t.tv_sec++;
+			t.tv_nsec -= 1000000000;
+		}
+		n_idle++;
+		pthread_cond_timedwait(&spark_cond, &rts_lock, &t);
+		n_idle--;
+	}
+	while (gc_pending)
+		pthread_cond_wait(&rts_cond, &rts_lock);
+	n_parked--;
+	pthread_mutex_unlock(&rts_lock);
+}
+#else
+#define HEAP_LOCK() ((void)0)
+#define HEAP_UNLOCK() ((void)0)
+#endif
+#ifdef DCC_THREADS
+static size_t chunk_uncounted(chunk_t* c)
+{
+	size_t n = c->used - c->counted;
+	c->counted = c->used;
+	return n;
+}
+#endif
+static chunk_t* chunk_new(size_t bytes)
+{
+	chunk_t* c;
+	if (bytes <= GC_CHUNK && heap_spare) {
+		c = heap_spare;
+		heap_spare = c->next;
+	} else {
+		size_t size = bytes > GC_CHUNK ? bytes : GC_CHUNK;
+		c = sys_alloc(sizeof(chunk_t) + size);
+		if (!c) gc_fatal("out of memory");
+		c->size = size;
+	}
+	c->next = NULL;
+	c->used = c->counted = 0;
+	if (heap_tail) heap_tail->next = c; else heap_head = c;
+	heap_tail = c;
+#ifdef DCC_THREADS
+	// with several allocating threads the heap is counted a chunk at a
+	// time, by what was used of it, when a thread moves on from it
+	if (alloc_chunk)
+		__atomic_fetch_add(&heap_since_gc, chunk_uncounted(alloc_chunk), __ATOMIC_RELAXED);
+#endif
+	alloc_chunk = c;
+	return c;
+}
+static void* gc_alloc(size_t bytes)
+{
+	bytes = (bytes + 7) & ~(size_t)7;
+	chunk_t* c = alloc_chunk;
+	if (!c || c->used + bytes > c->size) {
+		HEAP_LOCK();
+		c = chunk_new(bytes);
+		HEAP_UNLOCK();
+	}
+	void* p = c->data + c->used;
+	c->used += bytes;
+#ifndef DCC_THREADS
+	heap_since_gc += bytes;
+#else
+	thread_bytes += bytes;
+#endif
+	return p;
+}
+static comp_t* gc_node(void)
+{
+	comp_t* r = gc_alloc(sizeof(comp_t));
+	counters.allocs++;
+	memset(r, 0, sizeof(comp_t));
+	r->heap = 1;
+	return r;
+}
+static comp_t** gc_args(int n)
+{
+	if (n <= 0)
+		return NULL;
+	int k = 0;
+	while (((size_t)1 << k) < n) ++k;
+	counters.allocs++;
+	args_t* a = args_free[k];
+	if (a) {
+		args_free[k] = (args_t*)a->slot[0];
+		counters.reused++;
+	} else {
+		a = gc_alloc(sizeof(args_t) + SZ((size_t)1 << k));
+		a->cap = (size_t)1 << k;
+	}
+	return a->slot;
+}
+#ifndef DCC_THREADS
+// Give back an args block that no node refers to any more.
+// Only size-class blocks may be released (see args_pooled()).
+static void gc_args_release(comp_t** args)
+{
+	if (!args)
+		return;
+	args_t* a = ARGS_BLOCK(args);
+	int k = 0;
+	while (((size_t)2 << k) <= a->cap) ++k;
+	a->slot[0] = (comp_t*)args_free[k];
+	args_free[k] = a;
+}
+#endif
+static void gc_static_root(comp_t* c)
+{
+	HEAP_LOCK();
+	if (n_static_roots == max_static_roots) {
+		int max = max_static_roots ? 2*max_static_roots : 64;
+		comp_t** roots = sys_alloc(max*sizeof(comp_t*));
+		if (!roots) gc_fatal("out of memory");
+		if (static_roots) {
+			memcpy(roots, static_roots, n_static_roots*sizeof(comp_t*));
+			sys_free(static_roots, max_static_roots*sizeof(comp_t*));
+		}
+		static_roots = roots;
+		max_static_roots = max;
+	}
+	static_roots[n_static_roots++] = c;
+	HEAP_UNLOCK();
+}
+#ifndef DCC_NO_GC
+/*
+ * Copying collector.
+ * A collection copies everything reachable from the roots into fresh
+ * chunks (Cheney scan), placing each node's args block right behind the
+ * node, and then gives the old chunks back. A block too big to be inline
+ * keeps its size class, so it can still go on the free list.
+ * The roots are the addresses pushed on gc_roots (by eval, out, main and
+ * the generated supercombinators for their registers) plus the static
+ * nodes that eval has overwritten. A collection only starts at the safe
+ * point in eval(), so the allocation helpers may hold raw pointers.
+ */
+static comp_t* gc_copy(comp_t* c)
+{
+	// indirections left by eval are not worth keeping
+	while (c && c->heap && c->type == ct_ref)
+		c = c->val.ref;
+	if (!c || !c->heap)
+		return c;
+	if (c->type == ct_fwd)
+		return c->val.ref;
+	int n = c->args ? c->applied : 0;
+	size_t cap = n;
+	if (n > ARGS_INLINE)
+		for (cap = 1; cap < n; cap <<= 1)
+			;
+	comp_t* r = gc_alloc(sizeof(comp_t) + (n ? sizeof(args_t) + SZ(cap) : 0));
+	*r = *c;
+	r->args = NULL;
+	if (n) {
+		args_t* a = (args_t*)(r+1);
+		a->cap = cap;
+		memcpy(a->slot, c->args, SZ(n));
+		r->args = a->slot;
+	}
+	c->type = ct_fwd;
+	c->val.ref = r;
+	return r;
+}
+static void gc_scan(comp_t* r)
+{
+	int i;
+	if (r->type == ct_ref)
+		r->val.ref = gc_copy(r->val.ref);
+	if (r->args)
+		for (i=0; i<r->applied; ++i)
+			r->args[i] = gc_copy(r->args[i]);
+}
+// The evaluation stack also holds the nodes a thread has claimed, tagged
+// in the low bit (see reduce()).
+static void gc_thread_roots(comp_t*** roots, int nroots, comp_t** stack, size_t sp)
+{
+	int i;
+	size_t j;
+	for (i=0; i<nroots; ++i)
+		*roots[i] = gc_copy(*roots[i]);
+	for (j=0; j<sp; ++j) {
+		uintptr_t tag = (uintptr_t)stack[j] & 1;
+		stack[j] = (comp_t*)((uintptr_t)gc_copy((comp_t*)((uintptr_t)stack[j] - tag)) | tag);
+	}
+}
+#ifdef DCC_THREADS
+// Stop every other thread at a safe point. Returns 0 if some other
+// thread was collecting already; this one has waited for it instead.
+static int gc_stop_world(void)
+{
+	pthread_mutex_lock(&rts_lock);
+	if (gc_pending) {
+		pthread_mutex_unlock(&rts_lock);
+		rts_park(0);
+		return 0;
+	}
+	gc_pending = 1;
+	while (n_parked < n_threads - 1)
+		pthread_cond_wait(&rts_cond, &rts_lock);
+	pthread_mutex_unlock(&rts_lock);
+	return 1;
+}
+static void gc_start_world(void)
+{
+	pthread_mutex_lock(&rts_lock);
+	gc_pending = 0;
+	pthread_cond_broadcast(&rts_cond);
+	pthread_mutex_unlock(&rts_lock);
+}
+#endif
+void gc_collect(void)
+{
+	clock_t start = clock();
+	chunk_t *from, *c;
+	int i;
+#ifdef DCC_THREADS
+	if (!gc_stop_world())
+		return;
+	for (i=0; i<n_threads; ++i)
+		if (*threads[i].chunk) {
+			heap_since_gc += chunk_uncounted(*threads[i].chunk);
+			*threads[i].chunk = NULL;
+		}
+#else
+	alloc_chunk = NULL;
+#endif
+	from = heap_head;
+	heap_head = heap_tail = NULL;
+	memset(args_free, 0, sizeof(args_free));
+	gc_stats.allocated += heap_since_gc;
+	heap_since_gc = 0;
+#ifdef DCC_THREADS
+	for (i=0; i<n_threads; ++i) {
+		thread_t* t = &threads[i];
+		gc_thread_roots(t->roots, *t->nroots, *t->stack, *t->sp);
+		for (unsigned j = t->sparks->top; j != t->sparks->bottom; ++j)
+			t->sparks->spark[j % SPARKS] = gc_copy(t->sparks->spark[j % SPARKS]);
+	}
+#else
+	gc_thread_roots(gc_roots, gc_nroots, eval_stack, eval_sp);
+#endif
+	for (i=0; i<n_static_roots; ++i)
+		gc_scan(static_roots[i]);
+	for (c = heap_head; c; c = c->next)
+	{
+		size_t pos = 0;
+		while (pos < c->used)
+		{
+			comp_t* r = (comp_t*)(c->data + pos);
+			gc_scan(r);
+			pos += sizeof(comp_t);
+			if (r->args)
+				pos += (sizeof(args_t) + SZ(ARGS_BLOCK(r->args)->cap) + 7) & ~(size_t)7;
+		}
+	}
+	while (from)
+	{
+		c = from;
+		from = from->next;
+		if (c->size == GC_CHUNK) {
+			c->next = heap_spare;
+			heap_spare = c;
+		} else
+			sys_free(c, sizeof(chunk_t) + c->size);
+	}
+#ifdef DCC_THREADS
+	// what was copied is live, not allocated since the collection
+	for (heap_since_gc = 0, c = heap_head; c; c = c->next)
+		heap_since_gc += c->counted = c->used;
+	thread_bytes -= heap_since_gc;
+#endif
+	heap_live = heap_since_gc;
+	heap_since_gc = 0;
+	gc_stats.copied += heap_live;
+	gc_stats.collections++;
+	if (heap_live > gc_stats.max_live)
+		gc_stats.max_live = heap_live;
+	gc_stats.seconds += (double)(clock() - start) / CLOCKS_PER_SEC;
+	if (heap_live + GC_CHUNK > heap_limit)
+		gc_fatal("heap limit exceeded (set DCC_HEAP_LIMIT)");
+	gc_trigger = heap_live > GC_MIN_TRIGGER ? heap_live : GC_MIN_TRIGGER;
+#ifdef DCC_THREADS
+	// leave room for every thread to start a chunk of its own
+	if (gc_trigger < GC_MIN_TRIGGER + n_threads*GC_CHUNK)
+		gc_trigger = GC_MIN_TRIGGER + n_threads*GC_CHUNK;
+#endif
+	if (heap_live + gc_trigger > heap_limit)
+		gc_trigger = heap_limit - heap_live;
+#ifdef DCC_THREADS
+	gc_start_world();
+#endif
+}
+#ifdef DCC_THREADS
+#define GC_SAFE_POINT() do { \
+	if (__atomic_load_n(&gc_pending, __ATOMIC_ACQUIRE)) rts_park(0); \
+	if (__atomic_load_n(&heap_since_gc, __ATOMIC_RELAXED) >= gc_trigger) gc_collect(); \
+} while (0)
+#else
+#define GC_SAFE_POINT() do { if (heap_since_gc >= gc_trigger) gc_collect(); } while (0)
+#endif
+#else
+#define GC_SAFE_POINT() ((void)0)
+#endif
+static void gc_report(void)
+{
+	double run = (double)(clock() - gc_stats.start) / CLOCKS_PER_SEC;
+	size_t allocated = gc_stats.allocated + heap_since_gc;
+	counters_t total = counters;
+	int i;
+#ifdef DCC_THREADS
+	int j;
+	memset(&total, 0, sizeof total);
+	for (i=0; i<n_threads; ++i) {
+		chunk_t* c = *threads[i].chunk;
+		if (c)
+			allocated += c->used - c->counted;
+		total.allocs += threads[i].stats->allocs;
+		total.reused += threads[i].stats->reused;
+		total.in_place += threads[i].stats->in_place;
+		total.indirect += threads[i].stats->indirect;
+		for (j=0; j<REF_BUCKETS; ++j)
+			total.chains[j] += threads[i].stats->chains[j];
+	}
+#endif
+	fprintf(stderr, "alloc: %lu allocations (%lu args blocks reused), %zu bytes, %.0f allocations/s\n",
+			total.allocs, total.reused, allocated,
+			run > 0 ? total.allocs / run : 0.0);
+	fprintf(stderr, "update: %lu in place, %lu indirections; ref chains",
+			total.in_place, total.indirect);
+	for (i=0; i<REF_BUCKETS; ++i)
+		fprintf(stderr, " %s:%lu", (const char*[]){"0","1","2","3","4-7","8+"}[i],
+				total.chains[i]);
+	fprintf(stderr, "\n");
+#ifndef DCC_NO_GC
+	fprintf(stderr, "gc: %lu collections, %zu bytes copied, "
+			"max live %zu, heap limit %zu, %.3fs\n",
+			gc_stats.collections, gc_stats.copied,
+			gc_stats.max_live, heap_limit, gc_stats.seconds);
+#endif
+#ifdef DCC_THREADS
+	fprintf(stderr, "par: %d threads, %lu sparks, %lu run by workers\n",
+			n_threads, sparks_made, sparks_run);
+#endif
+}
+static void gc_init(void)
+{
+	const char* limit = getenv("DCC_HEAP_LIMIT");
+	if (limit) {
+		char* unit;
+		size_t v = strtoull(limit, &unit, 10);
+		switch (*unit) {
+		case 'g': case 'G': v <<= 10;
+		case 'm': case 'M': v <<= 10;
+		case 'k': case 'K': v <<= 10;
+		}
+		if (v < 2*GC_CHUNK)
+			v = 2*GC_CHUNK;
+		heap_limit = v;
+	}
+	if (gc_trigger + GC_CHUNK > heap_limit)
+		gc_trigger = heap_limit - GC_CHUNK;
+	gc_stats.start = clock();
+#ifdef DCC_THREADS
+	thread_register();
+#endif
+	atexit(gc_report);
+}
+/*
+ * Profiling. Code generated with dccsuper --profile gives every
+ * supercombinator and constructor a prof_t record and brackets its body
+ * with PROF_ENTER/PROF_LEAVE; building the runtime with -DDCC_PROFILE
+ * does the same for the primitives. Each record counts calls and the
+ * allocations, bytes and time spent in the function itself, not in the
+ * profiled functions it calls, and the records that were used are
+ * reported at exit, most expensive first. Without the flags none of this
+ * is compiled into the functions. In the threaded runtime every thread
+ * counts into its own prof_count, and the report adds them up.
+ */
+#ifdef DCC_THREADS
+#define PROF_SLOTS THREADS_MAX
+#define PROF_SELF self
+#else
+#define PROF_SLOTS 1
+#define PROF_SELF 0
+#endif
+static prof_t* prof_list;
+static DCC_TLS prof_frame* prof_top;
+static unsigned long long prof_clock(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000ull + t.tv_nsec;
+}
+static size_t prof_bytes(void)
+{
+#ifdef DCC_THREADS
+	return thread_bytes;
+#else
+	return gc_stats.allocated + heap_since_gc;
+#endif
+}
+typedef struct prof_total {
+	const char* name;
+	prof_count sum;
+} prof_total;
+static int prof_order(const void* a, const void* b)
+{
+	const prof_count* p = &((const prof_total*)a)->sum;
+	const prof_count* q = &((const prof_total*)b)->sum;
+	if (p->ns != q->ns)
+		return p->ns < q->ns ? 1 : -1;
+	return p->calls < q->calls ? 1 : p->calls > q->calls ? -1 : 0;
+}
+static void prof_report(void)
+{
+	int n = 0, i, j;
+	prof_t* p;
+	for (p = prof_list; p; p = p->next)
+		n++;
+	prof_total sorted[n > 0 ? n : 1];
+	for (p = prof_list, i = 0; p; p = p->next, i++) {
+		sorted[i].name = p->name;
+		memset(&sorted[i].sum, 0, sizeof(prof_count));
+		for (j = 0; j < PROF_SLOTS; j++) {
+			sorted[i].sum.calls += p->count[j].calls;
+			sorted[i].sum.allocs += p->count[j].allocs;
+			sorted[i].sum.bytes += p->count[j].bytes;
+			sorted[i].sum.ns += p->count[j].ns;
+		}
+	}
+	qsort(sorted, n, sizeof(prof_total), prof_order);
+	fprintf(stderr, "profile: %-20s %12s %12s %14s %10s\n",
+			"function", "calls", "allocs", "bytes", "ms");
+	for (i = 0; i < n; i++)
+		fprintf(stderr, "profile: %-20s %12lu %12lu %14zu %10.3f\n",
+				sorted[i].name, sorted[i].sum.calls, sorted[i].sum.allocs,
+				sorted[i].sum.bytes, sorted[i].sum.ns / 1e6);
+}
+// the first call of a function gives it its counts and puts it on
+// prof_list; in the threaded runtime two threads may race to do that
+static prof_count* prof_register(prof_t* p)
+{
+#ifdef DCC_THREADS
+	pthread_mutex_lock(&rts_lock);
+#endif
+	if (!p->count) {
+		prof_count* count = calloc(PROF_SLOTS, sizeof(prof_count));
+		if (!count)
+			gc_fatal("out of memory");
+		if (!prof_list)
+			atexit(prof_report);
+		p->next = prof_list;
+		prof_list = p;
+		__atomic_store_n(&p->count, count, __ATOMIC_RELEASE);
+	}
+#ifdef DCC_THREADS
+	pthread_mutex_unlock(&rts_lock);
+#endif
+	return p->count;
+}
+void prof_enter(prof_frame* f, prof_t* p)
+{
+	prof_count* count = __atomic_load_n(&p->count, __ATOMIC_ACQUIRE);
+	if (!count)
+		count = prof_register(p);
+	f->count = &count[PROF_SELF];
+	f->count->calls++;
+	f->child_ns = f->child_allocs = f->child_bytes = 0;
+	f->allocs = counters.allocs;
+	f->bytes = prof_bytes();
+	f->up = prof_top;
+	prof_top = f;
+	f->start = prof_clock();
+}
+void prof_leave(prof_frame* f)
+{
+	unsigned long long ns = prof_clock() - f->start;
+	unsigned long allocs = counters.allocs - f->allocs;
+	size_t bytes = prof_bytes() - f->bytes;
+	f->count->ns += ns - f->child_ns;
+	f->count->allocs += allocs - f->child_allocs;
+	f->count->bytes += bytes - f->child_bytes;
+	prof_top = f->up;
+	if (prof_top) {
+		prof_top->child_ns += ns;
+		prof_top->child_allocs += allocs;
+		prof_top->child_bytes += bytes;
+	}
+}
+#ifdef DCC_PROFILE
+#define PRIM_PROFILE(id, name) static prof_t prof_##id = { name }; PROF_ENTER(prof_##id)
+#define PRIM_PROFILE_END() PROF_LEAVE()
+#else
+#define PRIM_PROFILE(id, name)
+#define PRIM_PROFILE_END()
+#endif
+/*
+ * Applications.
+ * A node with at most ARGS_INLINE arguments gets its args block in the
+ * same allocation, right behind the node; larger ones take a block from
+ * the size classes. appv() builds the application of fun to k more
+ * arguments with a single allocation whatever fun already holds, and
+ * app1..app3 are the fixed-arity entry points used by generated code.
+ */
+static comp_t* node_args(int n)
+{
+	if (n > ARGS_INLINE) {
+		comp_t* r = gc_node();
+		r->args = gc_args(n);
+		return r;
+	}
+	if (n <= 0)
+		return gc_node();
+	comp_t* r = gc_alloc(sizeof(comp_t) + sizeof(args_t) + SZ(n));
+	counters.allocs++;
+	memset(r, 0, sizeof(comp_t));
+	r->heap = 1;
+	args_t* a = (args_t*)(r+1);
+	a->cap = n;
+	r->args = a->slot;
+	return r;
+}
+#ifndef DCC_THREADS
+// Blocks of more than ARGS_INLINE come in size classes, from gc_args()
+// or from the collector, and may go back on the free list.
+static int args_pooled(comp_t* c)
+{
+	return c->args && ARGS_BLOCK(c->args)->cap > ARGS_INLINE;
+}
+#endif
+comp_t* appv(comp_t* fun, int k_args, comp_t** argv)
+{
+	comp_t f;
+	for (;;) {
+		while (TYPE_OF(fun) == ct_ref) fun = fun->val.ref;
+		f = *fun;
+#ifdef DCC_THREADS
+		// Another thread may be reducing fun. Its fields stay as they
+		// are until it turns into an indirection, so the copy is good
+		// if it hasn't by now; a claimed application is copied unclaimed.
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (TYPE_OF(fun) == ct_ref)
+			continue;
+		if (f.type == ct_hole)
+			f.type = ct_sc;
+#endif
+		break;
+	}
+	comp_t* r = node_args(f.applied + k_args);
+	r->val = f.val;
+	r->arity = f.arity;
+	r->type = f.type;
+	r->strict = f.strict;
+	if (f.applied > 0)
+		memcpy(r->args, f.args, SZ(f.applied));
+	if (k_args > 0)
+		memcpy(r->args + f.applied, argv, SZ(k_args));
+	r->applied = f.applied + k_args;
+	return r;
+}
 comp_t* copy(comp_t* existing)
 {
-		while (existing->type == ct_ref) existing = existing->val.ref;
-    comp_t* new = calloc(1, sizeof(comp_t));
-    new->val = existing->val;
-    new->arity = existing->arity;
-    new->applied = existing->applied;
-    new->type = existing->type;
-    new->args = calloc(existing->applied, sizeof(comp_t*));
-    int i;
-    for (i=0; i<existing->applied; ++i)
-			new->args[i] = existing->args[i];
-		return new;
+	return appv(existing, 0, NULL);
+}
+comp_t* app1(comp_t* fun, comp_t* a)
+{
+	return appv(fun, 1, &a);
+}
+comp_t* app2(comp_t* fun, comp_t* a, comp_t* b)
+{
+	comp_t* argv[2] = { a, b };
+	return appv(fun, 2, argv);
 }
-void resize(comp_t* existing, int new_applied)
+comp_t* app3(comp_t* fun, comp_t* a, comp_t* b, comp_t* c)
 {
-	existing->args = realloc(existing->args, new_applied*sizeof(comp_t*));
+	comp_t* argv[3] = { a, b, c };
+	return appv(fun, 3, argv);
 }
 comp_t* constructor(int tag, int k_args, ...)
 {
   va_list args;
-  comp_t *r = calloc(1, sizeof(comp_t));
-  resize(r, r->applied + k_args);
+  comp_t *r = node_args(k_args);
   r->type = ct_alg;
   r->val.tag = tag;
   va_start(args, k_args);
@@ -51,160 +763,807 @@ comp_t* constructor(int tag, int k_args, ...)
 comp_t* app(comp_t* fun, int k_args, ...)
 {
   va_list args;
-  comp_t *r = copy(fun);
-  resize(r, r->applied + k_args);
+  comp_t* argv[k_args > 0 ? k_args : 1];
+  int i;
   va_start(args, k_args);
-  for(; k_args>0; k_args--)
-    r->args[r->applied++] = va_arg(args, comp_t *);
+  for(i=0; i<k_args; i++)
+    argv[i] = va_arg(args, comp_t *);
   va_end(args);
-  return r;
+  return appv(fun, k_args, argv);
+}
+/*
+ * letrec. Every binding starts as a hole the bindings can point at, and
+ * the hole becomes an indirection to the binding's value once that is
+ * built. Reducing a hole means a binding was needed to build itself.
+ */
+static void letrec_loop(comp_t** result, comp_t** args)
+{
+	gc_fatal("letrec binding used before it was built");
+}
+comp_t* letrec_hole(void)
+{
+	comp_t* r = gc_node();
+	r->val.sc = letrec_loop;
+	r->type = ct_sc;
+	return r;
+}
+void letrec_fill(comp_t* hole, comp_t* value)
+{
+	hole->type = ct_ref;
+	hole->val.ref = value;
 }
 comp_t* num(double g)
 {
-	comp_t* r = calloc(1, sizeof(comp_t));
+	comp_t* r = gc_node();
 	r->val.value = g;
 	r->type = ct_val;
 	return r;
 }
-extern comp_t sc_Cons;
-extern comp_t sc_Nil;
+/*
+ * Constants. Generated code points at statically initialised nodes for
+ * its literals (see the constant pool in dccsuper), and the primitives
+ * share True, False and the small integers, which also serve as the
+ * characters of strings.
+ */
+#define SMALL_INT(n) { .val = {.ival = (n)}, .type = ct_int }
+#define SMALL_INT4(n) SMALL_INT(n), SMALL_INT((n)+1), SMALL_INT((n)+2), SMALL_INT((n)+3)
+#define SMALL_INT16(n) SMALL_INT4(n), SMALL_INT4((n)+4), SMALL_INT4((n)+8), SMALL_INT4((n)+12)
+#define SMALL_INT64(n) SMALL_INT16(n), SMALL_INT16((n)+16), SMALL_INT16((n)+32), SMALL_INT16((n)+48)
+comp_t small_ints[256] = { SMALL_INT64(0), SMALL_INT64(64), SMALL_INT64(128), SMALL_INT64(192) };
+comp_t* inum(long long i)
+{
+	if (i >= 0 && i < 256)
+		return &small_ints[i];
+	comp_t* r = gc_node();
+	r->val.ival = i;
+	r->type = ct_int;
+	return r;
+}
+/*
+ * Packed strings. A ct_str node holds the bytes of a string and becomes
+ * a list only as far as something forces it: eval() turns it into a Cons
+ * of the first character and a packed rest. putstr() writes whatever is
+ * still packed in one go.
+ */
+comp_t* packed(const char* bytes, int length)
+{
+	if (length == 0)
+		return &sc_Nil;
+	comp_t* r = gc_node();
+	r->type = ct_str;
+	r->val.str = bytes;
+	r->arity = length;
+	return r;
+}
 comp_t* str(const char* strg)
 {
-  const char* t = strg;
-  while (*t != 0) ++t;
-  --t;
-  comp_t* r = &sc_Nil;
-  while (t >= strg)
-	{
-		r = app(&sc_Cons, 2, num(*t), r);
-		--t;
-	}
+	return packed(strg, strlen(strg));
+}
+static comp_t* unpack(comp_t* e)
+{
+#ifdef DCC_THREADS
+	// claimed like an application (see claim()), so one thread unpacks
+	// e and the others wait for the cell it publishes; e is returned to
+	// eval() to try again
+	enum comp_type type = ct_str;
+	if (!__atomic_compare_exchange_n(&e->type, &type, ct_hole, 0,
+			__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		return e;
+	__atomic_thread_fence(__ATOMIC_RELEASE); // for write_str()
+#endif
+	comp_t* r = node_args(2);
+	r->type = ct_alg;
+	r->val.tag = cons_tag;
+	r->args[0] = inum((unsigned char)e->val.str[0]);
+	r->args[1] = packed(e->val.str + 1, e->arity - 1);
+	r->applied = 2;
+	if (!e->heap)
+		gc_static_root(e);
+#ifdef DCC_THREADS
+	__atomic_store_n(&e->val.ref, r, __ATOMIC_RELAXED);
+	__atomic_store_n(&e->type, ct_ref, __ATOMIC_RELEASE);
+#else
+	e->type = ct_ref;
+	e->val.ref = r;
+#endif
 	return r;
 }
-comp_t *eval(comp_t *e);
-extern comp_t sc_True;
-extern comp_t sc_False;
+double dval(comp_t* c)
+{
+	return c->type == ct_int ? (double)c->val.ival : c->val.value;
+}
+// whether the forced number c equals the literal pattern i
+int num_is(comp_t* c, long long i)
+{
+	return c->type == ct_int ? c->val.ival == i : c->val.value == (double)i;
+}
+// a case none of whose patterns matched
+comp_t* match_fail(void)
+{
+	gc_fatal("no case alternative matched");
+	return NULL;
+}
+// force a number; the result is a plain value so no pointer outlives
+// a collection in the other operand's eval()
+double value(comp_t* c)
+{
+	return dval(eval(c));
+}
+long long ivalue(comp_t* c)
+{
+	c = eval(c);
+	return c->type == ct_int ? c->val.ival : (long long)c->val.value;
+}
+// Force both operands of a primitive and report whether both are
+// integers. args[] is rooted, so the values are read back through it
+// after the second eval.
+int both_int(comp_t** args)
+{
+	eval(args[0]);
+	eval(args[1]);
+	args[0] = follow(args[0]);
+	args[1] = follow(args[1]);
+	return args[0]->type == ct_int && args[1]->type == ct_int;
+}
+long long divisor(long long d)
+{
+	if (d == 0)
+		gc_fatal("division by zero");
+	return d;
+}
+#define ARITH(op) (both_int(args) \
+	? inum(args[0]->val.ival op args[1]->val.ival) \
+	: num(dval(args[0]) op dval(args[1])))
+#define COMPARE(op) ((both_int(args) \
+	? args[0]->val.ival op args[1]->val.ival \
+	: dval(args[0]) op dval(args[1])) ? &sc_True : &sc_False)
+// % and / truncate doubles to integers, as they always have
+#define IARITH(op) (both_int(args) \
+	? inum(args[0]->val.ival op divisor(args[1]->val.ival)) \
+	: num((long long)dval(args[0]) op divisor((long long)dval(args[1]))))
 void fun_3e(comp_t** r, comp_t** args) // >
 {
-    *r = app( (eval(args[0])->val.value > eval(args[1])->val.value) ? &sc_True : &sc_False, 0);
+    PRIM_PROFILE(3e, ">");
+    *r = COMPARE(>);
+    PRIM_PROFILE_END();
 }
-comp_t sc_3e = { fun_3e, 2 };
+comp_t sc_3e = { fun_3e, 2, .strict = 3 };
 void fun_3c(comp_t** r, comp_t** args) // <
 {
-    *r = app( (eval(args[0])->val.value < eval(args[1])->val.value) ? &sc_True : &sc_False, 0);
+    PRIM_PROFILE(3c, "<");
+    *r = COMPARE(<);
+    PRIM_PROFILE_END();
 }
-comp_t sc_3c = { fun_3c, 2 };
+comp_t sc_3c = { fun_3c, 2, .strict = 3 };
 void fun_3e3d(comp_t** r, comp_t** args) // >=
 {
-    *r = app( (eval(args[0])->val.value >= eval(args[1])->val.value) ? &sc_True : &sc_False, 0);
+    PRIM_PROFILE(3e3d, ">=");
+    *r = COMPARE(>=);
+    PRIM_PROFILE_END();
 }
-comp_t sc_3e3d = { fun_3e3d, 2 };
+comp_t sc_3e3d = { fun_3e3d, 2, .strict = 3 };
 void fun_3c3d(comp_t** r, comp_t** args) // <=
 {
-    *r = app( (eval(args[0])->val.value <= eval(args[1])->val.value) ? &sc_True : &sc_False, 0);
+    PRIM_PROFILE(3c3d, "<=");
+    *r = COMPARE(<=);
+    PRIM_PROFILE_END();
 }
-comp_t sc_3c3d = { fun_3c3d, 2 };
+comp_t sc_3c3d = { fun_3c3d, 2, .strict = 3 };
 void fun_3d3d(comp_t** r, comp_t** args) // ==
 {
-    *r = app( (eval(args[0])->val.value == eval(args[1])->val.value) ? &sc_True : &sc_False, 0);
+    PRIM_PROFILE(3d3d, "==");
+    *r = COMPARE(==);
+    PRIM_PROFILE_END();
 }
-comp_t sc_3d3d = { fun_3d3d, 2 };
+comp_t sc_3d3d = { fun_3d3d, 2, .strict = 3 };
 void fun_2a(comp_t** r, comp_t** args) // *
 {
-    *r = num( (eval(args[0])->val.value * eval(args[1])->val.value) );
+    PRIM_PROFILE(2a, "*");
+    *r = ARITH(*);
+    PRIM_PROFILE_END();
 }
-comp_t sc_2a = { fun_2a, 2 };
+comp_t sc_2a = { fun_2a, 2, .strict = 3 };
 void fun_2d(comp_t** r, comp_t** args) // -
 {
-    *r = num( (eval(args[0])->val.value - eval(args[1])->val.value) );
+    PRIM_PROFILE(2d, "-");
+    *r = ARITH(-);
+    PRIM_PROFILE_END();
 }
-comp_t sc_2d = { fun_2d, 2 };
+comp_t sc_2d = { fun_2d, 2, .strict = 3 };
 void fun_25(comp_t** r, comp_t** args) // %
 {
-    *r = num( ((int)eval(args[0])->val.value % (int)eval(args[1])->val.value) );
+    PRIM_PROFILE(25, "%");
+    *r = IARITH(%);
+    PRIM_PROFILE_END();
 }
-comp_t sc_25 = { fun_25, 2 };
+comp_t sc_25 = { fun_25, 2, .strict = 3 };
 void fun_2f(comp_t** r, comp_t** args) // /
 {
-    *r = num( ((int)eval(args[0])->val.value / (int)eval(args[1])->val.value) );
+    PRIM_PROFILE(2f, "/");
+    *r = IARITH(/);
+    PRIM_PROFILE_END();
 }
-comp_t sc_2f = { fun_2f, 2 };
+comp_t sc_2f = { fun_2f, 2, .strict = 3 };
 void fun_2b(comp_t** r, comp_t** args) // +
 {
-    *r = num( (eval(args[0])->val.value + eval(args[1])->val.value) );
+    PRIM_PROFILE(2b, "+");
+    *r = ARITH(+);
+    PRIM_PROFILE_END();
 }
-comp_t sc_2b = { fun_2b, 2 };
+comp_t sc_2b = { fun_2b, 2, .strict = 3 };
 void fun_2b23(comp_t** r, comp_t** args) // +#
 {
-    *r = num( (eval(args[0])->val.value + eval(args[1])->val.value) );
+    PRIM_PROFILE(2b23, "+#");
+    *r = ARITH(+);
+    PRIM_PROFILE_END();
+}
+comp_t sc_2b23 = { fun_2b23, 2, .strict = 3 };
+// box a worker's result (unum_t and its operations are in dcc.h)
+comp_t* unum_box(unum_t a)
+{
+	return a.integer ? inum(a.val.ival) : num(a.val.value);
 }
-comp_t sc_2b23 = { fun_2b23, 2 };
 // helper: follow redirects until target object found
 // may return NULL during eval
+static void count_chain(int hops)
+{
+    counters.chains[hops < 4 ? hops : hops < 8 ? 4 : 5]++;
+}
 comp_t *follow(comp_t *v)
 {
-    while(v && v->type==ct_ref) v = v->val.ref;
+    int hops = 0;
+    while(v && TYPE_OF(v)==ct_ref) {
+        v = v->val.ref;
+        hops++;
+    }
+    count_chain(hops);
     return v;
 }
 
-comp_t *eval(comp_t *e) {
-  if(e->type == ct_ref)
-    return e->val.ref = eval(e->val.ref); // follow and update
-  if(e->type == ct_val || e->type == ct_alg)
-    return e;
+/*
+ * Evaluation.
+ * eval() reduces a node to weak head normal form without recursing in C
+ * for the work it can see. Indirections are followed in a loop, and a
+ * saturated application that is strict in some arguments (the arithmetic
+ * primitives, or a supercombinator that starts with a case on an
+ * argument) is suspended on the evaluation stack while those arguments
+ * are reduced first; it is resumed, reduced and overwritten with its
+ * result afterwards. The stack grows on demand up to DCC_STACK_LIMIT
+ * frames. What still recurses in C (a case on a computed scrutinee, a
+ * ccall) is checked against the C stack limit, so a program that nests
+ * too deeply stops with a message instead of a crash.
+ */
+static DCC_TLS char* c_stack_base;
+static size_t c_stack_limit;
+#define C_STACK_CHECK() do { \
+  char here; \
+  if ((size_t)(c_stack_base - &here) > c_stack_limit) \
+    gc_fatal("C stack limit exceeded, evaluation nested too deeply"); \
+} while (0)
+int c_stack_deep(void)
+{
+  char here;
+  return (size_t)(c_stack_base - &here) > c_stack_limit/2;
+}
+static int whnf(comp_t* e)
+{
+  enum comp_type type = TYPE_OF(e);
+  return type == ct_val || type == ct_int || type == ct_alg
+    || (type == ct_sc && e->applied < e->arity);
+}
+static void eval_push(comp_t* e)
+{
+  if (eval_sp == eval_max) {
+    size_t max = eval_max ? 2*eval_max : 1024;
+    if (max > eval_limit)
+      max = eval_limit;
+    if (eval_sp == max)
+      gc_fatal("evaluation stack limit exceeded (set DCC_STACK_LIMIT)");
+    comp_t** stack = sys_alloc(max*sizeof(comp_t*));
+    if (!stack) gc_fatal("out of memory");
+    if (eval_stack) {
+      memcpy(stack, eval_stack, eval_sp*sizeof(comp_t*));
+      sys_free(eval_stack, eval_max*sizeof(comp_t*));
+    }
+    eval_stack = stack;
+    eval_max = max;
+  }
+  eval_stack[eval_sp++] = e;
+}
+#ifndef DCC_THREADS
+// Overwrite the reduced node e with its value r when r's arguments fit
+// in e's own args block, so that readers of e need no indirection.
+// Only a single thread may do this, since the fields change one by one.
+static int update(comp_t* e, comp_t* r)
+{
+  int n = r->args ? r->applied : 0;
+  if (!whnf(r) && r->type != ct_str)
+    return 0;
+  if (n > 0 && (!e->heap || !e->args || ARGS_BLOCK(e->args)->cap < (size_t)n))
+    return 0;
+  if (n > 0)
+    memcpy(e->args, r->args, SZ(n));
+  else if (e->args) {
+    if (args_pooled(e))
+      gc_args_release(e->args);
+    e->args = NULL;
+  }
+  e->val = r->val;
+  e->arity = r->arity;
+  e->applied = r->applied;
+  e->strict = r->strict;
+  e->type = r->type;
+  counters.in_place++;
+  return 1;
+}
+#endif
+#ifdef DCC_THREADS
+#define CLAIMED(e) ((comp_t*)((uintptr_t)(e) | 1))
+// Claim e for this thread by turning it into a hole. The claim is also
+// pushed on the evaluation stack, where the collector finds it and
+// eval() can tell a hole of its own thread from someone else's.
+static int claim(comp_t* e)
+{
+  enum comp_type type = ct_sc;
+  if (!__atomic_compare_exchange_n(&e->type, &type, ct_hole, 0,
+        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    return 0;
+  eval_push(CLAIMED(e));
+  return 1;
+}
+static int claimed_here(comp_t* e)
+{
+  size_t i;
+  for (i = eval_sp; i-- > 0; )
+    if (eval_stack[i] == CLAIMED(e))
+      return 1;
+  return 0;
+}
+#endif
+// Run the supercombinator of the saturated application e and let e
+// redirect to the result. With threads, e is returned untouched if
+// another thread has claimed it first.
+static comp_t* reduce(comp_t* e)
+{
+  int roots = gc_nroots;
   comp_t hold = { .val = {.ref = NULL}, .type = ct_ref };
-  //hold.wnext = root; root = &hold;
-  while(e->type != ct_val && e->type != ct_alg && e->applied >= e->arity) {
-    // evaluate and let 'e' redirect to the result
-    size_t keep = e->applied - e->arity;
-    e->val.sc(&hold.val.ref, e->args);
-    hold.val.ref = follow(hold.val.ref);
-    if(keep > 0) {
-      comp_t *r = hold.val.ref = copy(hold.val.ref);
-      resize(r, r->applied + keep);
-      memcpy(r->args + r->applied, e->args + e->arity, SZ(keep));
-      r->applied += keep;
+  GC_PUSH(e);
+  GC_SAFE_POINT();
+#ifdef DCC_THREADS
+  if (!claim(e)) {
+    gc_nroots = roots;
+    return e;
+  }
+#endif
+#ifdef DCC_NO_GC
+  comp_t** argv = e->args;
+#else
+  // the supercombinator gets its own rooted copy of the arguments,
+  // since a collection may move e->args while it runs
+  int i;
+  comp_t* argv[e->arity > 0 ? e->arity : 1];
+  memcpy(argv, e->args, SZ(e->arity));
+  GC_RESERVE(e->arity);
+  for (i=0; i<e->arity; ++i)
+    GC_PUSH(argv[i]);
+#endif
+  int keep = e->applied - e->arity;
+  e->val.sc(&hold.val.ref, argv);
+  hold.val.ref = follow(hold.val.ref);
+  if (!e->heap)
+    gc_static_root(e);
+#ifdef DCC_THREADS
+  if (keep > 0)
+    hold.val.ref = appv(hold.val.ref, keep, e->args + e->arity);
+  // others may still be reading the arguments, so they stay
+  eval_sp--;
+  e->val.ref = hold.val.ref;
+  __atomic_store_n(&e->type, ct_ref, __ATOMIC_RELEASE);
+  counters.indirect++;
+#else
+  if (keep > 0) {
+    // apply the result to the surplus arguments, in e itself if there
+    // is room; e is then still an application and eval() carries on
+    comp_t* f = hold.val.ref;
+    int n = f->applied + keep;
+    if (f->type == ct_sc && ARGS_BLOCK(e->args)->cap >= (size_t)n) {
+      comp_t* surplus[keep];
+      memcpy(surplus, e->args + e->arity, SZ(keep));
+      if (f->applied > 0)
+        memcpy(e->args, f->args, SZ(f->applied));
+      memcpy(e->args + f->applied, surplus, SZ(keep));
+      e->val = f->val;
+      e->arity = f->arity;
+      e->strict = f->strict;
+      e->applied = n;
+      counters.in_place++;
+      gc_nroots = roots;
+      return e;
     }
+    hold.val.ref = appv(f, keep, e->args + e->arity);
+  }
+  if (!update(e, hold.val.ref)) {
     e->type = ct_ref;
     e->val.ref = hold.val.ref;
-    free(e->args); e->args = NULL;
-    e = e->val.ref;
-  };
-  //assert(root == &hold); root = root->wnext;
+    if (args_pooled(e))
+      gc_args_release(e->args);
+    e->args = NULL;
+    counters.indirect++;
+  } else
+    hold.val.ref = e;
+#endif
+  gc_nroots = roots;
+  return hold.val.ref;
+}
+// follow() that also points every indirection on the way at the end
+static comp_t* shorten(comp_t* v)
+{
+  comp_t* end = follow(v);
+  while (v != end) {
+    comp_t* next = v->val.ref;
+    v->val.ref = end;
+    v = next;
+  }
+  return end;
+}
+comp_t *eval(comp_t *e) {
+  C_STACK_CHECK();
+  int roots = gc_nroots;
+  size_t base = eval_sp;
+  comp_t* start = e;
+  GC_PUSH(start);
+  GC_PUSH(e);
+  for (;;) {
+    int hops = 0;
+    while (TYPE_OF(e) == ct_ref) {
+      e = e->val.ref;
+      hops++;
+    }
+    count_chain(hops);
+    if (TYPE_OF(e) == ct_str) {
+      e = unpack(e);
+      continue;
+    }
+#ifdef DCC_THREADS
+    if (TYPE_OF(e) == ct_hole) {
+      if (claimed_here(e))
+        gc_fatal("a value depends on itself");
+      // the owner may take a while, so back off from yielding to
+      // sleeping up to a millisecond at a time
+      for (unsigned delay = 0; TYPE_OF(e) == ct_hole; ) {
+        GC_SAFE_POINT();
+        if (delay == 0)
+          sched_yield();
+        else
+          usleep(delay);
+        delay = delay < 10 ? delay + 1 : delay < 1000 ? 2*delay : 1000;
+      }
+      continue;
+    }
+#endif
+    if (!whnf(e)) {
+      unsigned strict = e->strict;
+      int i = 0;
+      // a packed string counts as reduced: the callee unpacks it when
+      // it looks at it. Arguments that are done are handed to the callee
+      // without the indirections in front of them.
+      for (; strict; ++i, strict >>= 1) {
+        if (!(strict & 1))
+          continue;
+        comp_t* arg = shorten(e->args[i]);
+        if (!whnf(arg) && TYPE_OF(arg) != ct_str)
+          break;
+        e->args[i] = arg;
+      }
+      if (strict) {
+        eval_push(e);
+        e = e->args[i];
+      } else
+        e = reduce(e);
+      continue;
+    }
+    if (eval_sp == base)
+      break;
+    e = eval_stack[--eval_sp];
+  }
+  // shorten the indirections we came through, or fill them in with
+  // the value where it fits
+  while (TYPE_OF(start) == ct_ref && start != e) {
+    comp_t* next = start->val.ref;
+#ifndef DCC_THREADS
+    if (!update(start, e))
+#endif
+      start->val.ref = e;
+    start = next;
+  }
+  gc_nroots = roots;
+  return e;
+}
+// Generated code calls a saturated known supercombinator directly when
+// its value is wanted at once; the call gets the stack check and safe
+// point that eval() and reduce() would have made. The caller roots argv.
+void call_known(void (*fun)(comp_t**, comp_t**), comp_t** result, comp_t** argv)
+{
+  C_STACK_CHECK();
+  GC_SAFE_POINT();
+  fun(result, argv);
+}
+/*
+ * Parallel evaluation. par a b sparks a, offering it to other threads,
+ * and returns b; seq a b reduces a before it returns b. A runtime built
+ * with -DDCC_THREADS starts DCC_THREADS-1 workers (by default one less
+ * than there are cores). A worker takes the newest spark from its own
+ * pool or steals the oldest one from another thread's. Before a thread
+ * reduces an application it claims it by turning it into a ct_hole, so
+ * that nothing is reduced twice; another thread that needs the node
+ * waits, stopping for collections, until it has been overwritten with
+ * its result. Without threads, par is just its second argument.
+ */
+#ifdef DCC_THREADS
+static void spark(comp_t* e)
+{
+  e = follow(e);
+  if (TYPE_OF(e) != ct_sc || whnf(e))
+    return;
+  spark_pool* p = my_sparks;
+  SPIN_LOCK(p->lock);
+  // a spark is only a hint, so one that doesn't fit is dropped
+  if (p->bottom - p->top < SPARKS) {
+    p->spark[p->bottom++ % SPARKS] = e;
+    __atomic_fetch_add(&sparks_made, 1, __ATOMIC_RELAXED);
+  }
+  SPIN_UNLOCK(p->lock);
+  if (__atomic_load_n(&n_idle, __ATOMIC_RELAXED)) {
+    pthread_mutex_lock(&rts_lock);
+    pthread_cond_signal(&spark_cond);
+    pthread_mutex_unlock(&rts_lock);
+  }
+}
+static comp_t* spark_take(void)
+{
+  comp_t* e = NULL;
+  int i;
+  SPIN_LOCK(my_sparks->lock);
+  if (my_sparks->bottom != my_sparks->top)
+    e = my_sparks->spark[--my_sparks->bottom % SPARKS];
+  SPIN_UNLOCK(my_sparks->lock);
+  for (i = 1; !e && i < n_threads; ++i) {
+    spark_pool* p = threads[(self + i) % n_threads].sparks;
+    if (p->bottom == p->top)
+      continue;
+    SPIN_LOCK(p->lock);
+    if (p->bottom != p->top)
+      e = p->spark[p->top++ % SPARKS];
+    SPIN_UNLOCK(p->lock);
+  }
   return e;
 }
+static void* worker(void* arg)
+{
+  char stack_base;
+  comp_t* e = NULL;
+  c_stack_base = &stack_base;
+  thread_register();
+  GC_PUSH(e);
+  for (;;) {
+    e = spark_take();
+    if (!e) {
+      rts_park(1);
+      continue;
+    }
+    // a spark that has been evaluated meanwhile has fizzled
+    e = follow(e);
+    if (TYPE_OF(e) == ct_sc && !whnf(e)) {
+      __atomic_fetch_add(&sparks_run, 1, __ATOMIC_RELAXED);
+      eval(e);
+    }
+    e = NULL;
+  }
+  return NULL;
+}
+static void par_init(void)
+{
+  const char* count = getenv("DCC_THREADS");
+  long n = count ? strtol(count, NULL, 10) : sysconf(_SC_NPROCESSORS_ONLN);
+  pthread_attr_t attr;
+  pthread_t thread;
+  if (n > THREADS_MAX)
+    n = THREADS_MAX;
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, c_stack_limit + c_stack_limit/7);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  for (long i = 1; i < n; ++i)
+    if (pthread_create(&thread, &attr, worker, NULL) != 0)
+      gc_fatal("cannot start worker thread");
+  pthread_attr_destroy(&attr);
+  // the workers register before there is anything to collect
+  pthread_mutex_lock(&rts_lock);
+  while (n_threads < n)
+    pthread_cond_wait(&rts_cond, &rts_lock);
+  pthread_mutex_unlock(&rts_lock);
+}
+#endif
+void fun_par(comp_t** r, comp_t** args)
+{
+#ifdef DCC_THREADS
+  spark(args[0]);
+#endif
+  *r = args[1];
+}
+comp_t sc_par = { fun_par, 2 };
+void fun_seq(comp_t** r, comp_t** args)
+{
+  eval(args[0]);
+  *r = args[1];
+}
+comp_t sc_seq = { fun_seq, 2, .strict = 1 };
+/*
+ * Output. Everything a program prints goes through one large buffer
+ * that is written with a single write() when it fills up and at exit.
+ * write_str and write_num put a whole forced string or number in the
+ * buffer in one call; the compiler maps ccall putchar/putstr/putnum
+ * onto these.
+ */
+#ifndef OUT_BUFFER
+#define OUT_BUFFER (1<<16)
+#endif
+static char out_buf[OUT_BUFFER];
+static size_t out_len;
+#ifdef DCC_THREADS
+static int out_lock;
+#define OUT_LOCK() SPIN_LOCK(out_lock)
+#define OUT_UNLOCK() SPIN_UNLOCK(out_lock)
+#else
+#define OUT_LOCK() ((void)0)
+#define OUT_UNLOCK() ((void)0)
+#endif
+static void out_write(void)
+{
+	size_t done = 0;
+	while (done < out_len) {
+		ssize_t n = write(1, out_buf + done, out_len - done);
+		if (n <= 0)
+			break;
+		done += n;
+	}
+	out_len = 0;
+}
+void out_flush(void)
+{
+	OUT_LOCK();
+	out_write();
+	OUT_UNLOCK();
+}
+static void out_bytes(const char* bytes, size_t n)
+{
+	OUT_LOCK();
+	while (n > 0) {
+		if (out_len == OUT_BUFFER)
+			out_write();
+		size_t k = OUT_BUFFER - out_len;
+		if (k > n)
+			k = n;
+		memcpy(out_buf + out_len, bytes, k);
+		out_len += k;
+		bytes += k;
+		n -= k;
+	}
+	OUT_UNLOCK();
+}
+void write_char(long long ch)
+{
+	OUT_LOCK();
+	if (out_len == OUT_BUFFER)
+		out_write();
+	out_buf[out_len++] = (char)ch;
+	OUT_UNLOCK();
+}
+// Write a string, packed or as a list of characters.
+void write_str(comp_t* s)
+{
+	int roots = gc_nroots;
+	GC_PUSH(s);
+	for (;;) {
+		s = follow(s);
+		if (TYPE_OF(s) == ct_str) {
+#ifdef DCC_THREADS
+			// s is not claimed, so another thread may unpack it while
+			// it is read: the bytes are good if it is still packed after
+			const char* bytes = __atomic_load_n(&s->val.str, __ATOMIC_RELAXED);
+			int length = __atomic_load_n(&s->arity, __ATOMIC_RELAXED);
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (TYPE_OF(s) != ct_str)
+				continue;
+			out_bytes(bytes, length);
+#else
+			out_bytes(s->val.str, s->arity);
+#endif
+			break;
+		}
+		s = eval(s);
+		if (s->type != ct_alg || s->applied != 2)
+			break;
+		write_char(ivalue(s->args[0]));
+		s = s->args[1];
+	}
+	gc_nroots = roots;
+}
+void write_num(comp_t* c)
+{
+	char text[32];
+	int n;
+	c = eval(c);
+	if (c->type == ct_int)
+		n = snprintf(text, sizeof text, "%lld", c->val.ival);
+	else
+		n = snprintf(text, sizeof text, "%.17g", c->val.value);
+	out_bytes(text, n);
+}
+// Forces and walks a result. The last field of a constructor is
+// followed in a loop so that long lists don't recurse.
 void out(comp_t* r)
 {
 	//puts("out");
-	int i;
-	const char* types[] = {"sc","ref","val", "alg"};
-	switch (r->type) {
-	default:
-	case ct_sc:
-	case ct_ref:
-		//printf("r %p r->type %s r->val.value %f\n", r, types[r->type], r->val.value);
-		r = eval(r);
-		out(r);
-		break;
-	case ct_val:
-		//fprintf(stderr,"r %p r->type %s r->val.value %f\n", r, types[r->type], r->val.value);
-		break;
-	case ct_alg:
-		//afprintf(stderr,"r %p r->type %s r->val.tag %d r->applied %d\n", r, types[r->type], r->val.tag, r->applied);
-		for (i=0; i<r->applied; ++i)
-		{
-			//puts("---");
-			out(r->args[i]);
+	int i, roots = gc_nroots;
+	GC_PUSH(r);
+	for (;;) {
+		switch (r->type) {
+		default:
+		case ct_sc:
+		case ct_ref:
+			//printf("r %p r->type %s r->val.value %f\n", r, types[r->type], r->val.value);
+			r = eval(r);
+			continue;
+		case ct_val:
+			//fprintf(stderr,"r %p r->type %s r->val.value %f\n", r, types[r->type], r->val.value);
+			break;
+		case ct_int:
+			//fprintf(stderr,"r %p r->type %s r->val.ival %lld\n", r, types[r->type], r->val.ival);
+			break;
+		case ct_alg:
+			//afprintf(stderr,"r %p r->type %s r->val.tag %d r->applied %d\n", r, types[r->type], r->val.tag, r->applied);
+			if (r->applied == 0)
+				break;
+			for (i=0; i<r->applied-1; ++i)
+			{
+				//puts("---");
+				out(r->args[i]);
+			}
+			r = r->args[r->applied-1];
+			continue;
 		}
 		break;
 	}
+	gc_nroots = roots;
+}
+static void eval_init(char* stack_base)
+{
+	struct rlimit rl;
+	const char* limit = getenv("DCC_STACK_LIMIT");
+	if (limit)
+		eval_limit = strtoull(limit, NULL, 10);
+	if (eval_limit < 1024)
+		eval_limit = 1024;
+	c_stack_base = stack_base;
+	c_stack_limit = 8UL<<20;
+	if (getrlimit(RLIMIT_STACK, &rl) == 0)
+		c_stack_limit = rl.rlim_cur == RLIM_INFINITY ? 1UL<<30 : rl.rlim_cur;
+	// leave room for the frames between two checks
+	c_stack_limit -= c_stack_limit/8;
 }
 int main(int argc,const char** argv)
 {
   extern comp_t sc_main;
+  char stack_base;
+  gc_init();
+  eval_init(&stack_base);
+#ifdef DCC_THREADS
+  par_init();
+#endif
+  atexit(out_flush);
   comp_t* r = app(&sc_main, 0);
-  eval(r);
-  r = follow(r);
+  GC_PUSH(r);
+  r = eval(r);
 	fprintf(stderr,"main: \n");
 	out(r);
 	fflush(stdout);
@@ -0,0 +1,26 @@
+#!/bin/bash
+# Allocation benchmark. Each program is compiled with the prelude and
+# linked against the runtime with and without the collector; the
+# runtime's exit statistics report allocations per second. parmap.x1 is
+# then run on the threaded runtime with 1, 4 and 8 threads: the number
+# of collections should stay about the same as threads are added.
+DCCSUPER=${DCCSUPER:-./dccsuper}
+for prog in ${@:-fact.x1 sumlist.x1}; do
+	cat prelude-ctor.x1 $prog > bench.x1
+	$DCCSUPER bench.x1 > bench.c
+	cat base.c bench.c > bench.lnk.c
+	for mode in "" -DDCC_NO_GC; do
+		gcc -O2 -I. $mode -o bench.exe bench.lnk.c
+		echo "== $prog ${mode:-(collected)}"
+		./bench.exe > /dev/null
+	done
+done
+cat prelude-ctor.x1 parmap.x1 > bench.x1
+$DCCSUPER bench.x1 > bench.c
+cat base.c bench.c > bench.lnk.c
+gcc -O2 -I. -DDCC_THREADS -o bench.exe bench.lnk.c -lpthread
+for n in 1 4 8; do
+	echo "== parmap.x1 DCC_THREADS=$n"
+	DCC_THREADS=$n ./bench.exe > /dev/null
+done
+rm -f bench.x1 bench.c bench.lnk.c bench.exe
@@ -0,0 +1,180 @@
+/*
+ * The runtime as generated code sees it: the node layout, the root
+ * stack, the profiling hooks, the unboxed numbers and the entry points
+ * the compiler emits calls to. base.c includes it, and so does the C
+ * that dccsuper writes for a module or for a program that imports one,
+ * so that each can be compiled on its own and linked with base.o.
+ */
+#ifndef DCC_H
+#define DCC_H
+#include <stddef.h>
+#ifdef DCC_THREADS
+#define DCC_TLS __thread
+#else
+#define DCC_TLS
+#endif
+
+// ct_hole: an application some thread is reducing (threaded runtime only)
+enum comp_type { ct_sc, ct_ref, ct_val, ct_alg, ct_int, ct_str, ct_fwd, ct_hole };
+typedef struct comp_t {
+	 union {
+		void (*sc)(struct comp_t** result, struct comp_t** args);
+		struct comp_t* ref;
+		double value;
+		long long ival;
+		const char* str; // ct_str: the bytes, with their count in arity
+    unsigned tag;
+	 } val;
+	 int arity;
+	 int applied;
+	 enum comp_type type;
+	 short heap; // nonzero when allocated from the collected heap
+	 unsigned short strict; // bit i: argument i is reduced before the call
+   struct comp_t** args;
+} comp_t;
+#ifdef DCC_THREADS
+#define TYPE_OF(e) __atomic_load_n(&(e)->type, __ATOMIC_ACQUIRE)
+#else
+#define TYPE_OF(e) ((e)->type)
+#endif
+
+// the root stack: generated code pushes its registers and pops them
+// by resetting gc_nroots
+#define GC_ROOTS_MAX (1<<20)
+#ifdef DCC_THREADS
+extern DCC_TLS comp_t*** gc_roots;
+#else
+extern comp_t** gc_roots[GC_ROOTS_MAX];
+#endif
+extern DCC_TLS int gc_nroots;
+void gc_fatal(const char* msg);
+#ifdef DCC_NO_GC
+#define GC_PUSH(v) ((void)0)
+#define GC_RESERVE(N) ((void)0)
+#else
+#define GC_PUSH(v) (gc_roots[gc_nroots++] = &(v))
+#define GC_RESERVE(N) do { if (gc_nroots + (N) > GC_ROOTS_MAX) gc_fatal("root stack overflow"); } while (0)
+#endif
+
+typedef struct prof_count {
+	unsigned long calls, allocs;
+	size_t bytes;
+	unsigned long long ns;
+} prof_count;
+typedef struct prof_t {
+	const char* name;
+	prof_count* count; // one per thread, from the first call on
+	struct prof_t* next;
+} prof_t;
+typedef struct prof_frame {
+	prof_count* count;
+	unsigned long long start, child_ns;
+	unsigned long allocs, child_allocs;
+	size_t bytes, child_bytes;
+	struct prof_frame* up;
+} prof_frame;
+void prof_enter(prof_frame* f, prof_t* p);
+void prof_leave(prof_frame* f);
+#define PROF_ENTER(p) prof_frame prof_f; prof_enter(&prof_f, &(p))
+#define PROF_LEAVE() prof_leave(&prof_f)
+
+comp_t* appv(comp_t* fun, int k_args, comp_t** argv);
+comp_t* copy(comp_t* existing);
+comp_t* app1(comp_t* fun, comp_t* a);
+comp_t* app2(comp_t* fun, comp_t* a, comp_t* b);
+comp_t* app3(comp_t* fun, comp_t* a, comp_t* b, comp_t* c);
+comp_t* constructor(int tag, int k_args, ...);
+comp_t* app(comp_t* fun, int k_args, ...);
+comp_t* letrec_hole(void);
+void letrec_fill(comp_t* hole, comp_t* value);
+comp_t* num(double g);
+comp_t* inum(long long i);
+comp_t* packed(const char* bytes, int length);
+comp_t* str(const char* strg);
+comp_t *eval(comp_t *e);
+comp_t *follow(comp_t *v);
+double dval(comp_t* c);
+int num_is(comp_t* c, long long i);
+comp_t* match_fail(void);
+double value(comp_t* c);
+long long ivalue(comp_t* c);
+long long divisor(long long d);
+int c_stack_deep(void);
+void call_known(void (*fun)(comp_t**, comp_t**), comp_t** result, comp_t** argv);
+void write_char(long long ch);
+void write_str(comp_t* s);
+void write_num(comp_t* c);
+
+// the shared constants, and what the program itself has to define
+extern comp_t small_ints[256];
+extern comp_t sc_True, sc_False, sc_Nil, sc_Cons;
+extern unsigned cons_tag;
+
+// the primitives, by the c_id of their operator
+#define DCC_PRIMITIVE(id) void fun_##id(comp_t** r, comp_t** args); extern comp_t sc_##id;
+DCC_PRIMITIVE(3e) DCC_PRIMITIVE(3c) DCC_PRIMITIVE(3e3d) DCC_PRIMITIVE(3c3d)
+DCC_PRIMITIVE(3d3d) DCC_PRIMITIVE(2a) DCC_PRIMITIVE(2d) DCC_PRIMITIVE(25)
+DCC_PRIMITIVE(2f) DCC_PRIMITIVE(2b) DCC_PRIMITIVE(2b23)
+DCC_PRIMITIVE(par) DCC_PRIMITIVE(seq)
+#undef DCC_PRIMITIVE
+
+/*
+ * Unboxed numbers. The compiler gives a function that is strict in all
+ * its arguments and only does arithmetic on them a worker, work_<name>,
+ * that takes and returns unum_t values in C variables, and fun_<name>
+ * unboxes the arguments, calls it and boxes the result. The operations
+ * follow the primitives: integers stay integers unless a double is
+ * involved. Workers recurse in C, so once half the C stack is used
+ * (c_stack_deep) a worker hands its call back to eval() as an application
+ * and fun_<name> runs the ordinary boxed code, which eval() continues on
+ * its own stack.
+ */
+typedef struct unum_t {
+	int integer;
+	union {
+		long long ival;
+		double value;
+	} val;
+} unum_t;
+static inline unum_t unum_int(long long i)
+{
+	unum_t r = { 1, {.ival = i} };
+	return r;
+}
+static inline unum_t unum_real(double d)
+{
+	unum_t r = { 0, {.value = d} };
+	return r;
+}
+static inline double unum_dval(unum_t a)
+{
+	return a.integer ? (double)a.val.ival : a.val.value;
+}
+// numbers are read in place, anything else is forced first
+static inline unum_t unum_of(comp_t* c)
+{
+	enum comp_type type = TYPE_OF(c);
+	if (type != ct_int && type != ct_val)
+		c = eval(c);
+	return c->type == ct_int ? unum_int(c->val.ival) : unum_real(c->val.value);
+}
+comp_t* unum_box(unum_t a);
+#define UNUM_ARITH(id, op) static inline unum_t unum_##id(unum_t a, unum_t b) \
+	{ return a.integer && b.integer ? unum_int(a.val.ival op b.val.ival) : unum_real(unum_dval(a) op unum_dval(b)); }
+#define UNUM_IARITH(id, op) static inline unum_t unum_##id(unum_t a, unum_t b) \
+	{ return a.integer && b.integer ? unum_int(a.val.ival op divisor(b.val.ival)) \
+		: unum_int((long long)unum_dval(a) op divisor((long long)unum_dval(b))); }
+#define UNUM_COMPARE(id, op) static inline int unum_##id(unum_t a, unum_t b) \
+	{ return a.integer && b.integer ? a.val.ival op b.val.ival : unum_dval(a) op unum_dval(b); }
+UNUM_COMPARE(3e, >)
+UNUM_COMPARE(3c, <)
+UNUM_COMPARE(3e3d, >=)
+UNUM_COMPARE(3c3d, <=)
+UNUM_COMPARE(3d3d, ==)
+UNUM_ARITH(2a, *)
+UNUM_ARITH(2d, -)
+UNUM_IARITH(25, %)
+UNUM_IARITH(2f, /)
+UNUM_ARITH(2b, +)
+UNUM_ARITH(2b23, +)
+#endif
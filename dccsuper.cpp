@@ -6,24 +6,39 @@
  */
 #include <string>
 #include <iostream>
-#include <fstream>
 #include <vector>
 #include <list>
 #include <algorithm>
 #include <sstream>
 #include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <optional>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <exception>
+#include <set>
 #include <iomanip>
+#include <type_traits>
+#include <climits>
+#include <fstream>
+#include <string_view>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #define LOG(fmt) cout << __PRETTY_FUNCTION__ << ": " << fmt << " : " << __FILE__ << ":" << __LINE__ << endl
 
 using namespace std;
-static vector<int> indented;
 
 enum TokenType {
 	TT_VARID, TT_CONID, TT_INTEGER, TT_DOUBLE, TT_STRING, TT_OPER,
-	TT_DATA, TT_CASE, TT_OF, TT_ARROW_TO, TT_ARROW_FROM,
+	TT_DATA, TT_CASE, TT_OF, TT_LET, TT_LETREC, TT_IN, TT_ARROW_TO, TT_ARROW_FROM,
 	TT_LPAREN, TT_RPAREN, TT_PIPE,
 	TT_EQUALS,
 	TT_SEMI, TT_INDENT, TT_OUTDENT,
@@ -32,7 +47,7 @@ enum TokenType {
 const char* TokenTypeStr[] =
 {
 	"TT_VARID", "TT_CONID", "TT_INTEGER", "TT_DOUBLE", "TT_STRING", "TT_OPER",
-	"TT_DATA", "TT_CASE", "TT_OF", "TT_ARROW_TO", "TT_ARROW_FROM",
+	"TT_DATA", "TT_CASE", "TT_OF", "TT_LET", "TT_LETREC", "TT_IN", "TT_ARROW_TO", "TT_ARROW_FROM",
 	"TT_LPAREN", "TT_RPAREN", "TT_PIPE",
 	"TT_EQUALS",
 	"TT_SEMI", "TT_INDENT", "TT_OUTDENT",
@@ -46,9 +61,11 @@ struct Token {
 	Token() : type(TT_EOF) {}
 	Token(TokenType type) : type(type){}
 	TokenType type;
-	string text;
+	string_view text; // a slice of the source
 	double dval = 0;
-	int ival = 0;
+	long long ival = 0;
+	int line = 0;
+	int column = 0;
 	ostream& print(ostream& out) const;
 };
 ostream& Token::print(ostream& out) const
@@ -75,25 +92,112 @@ ostream& operator<<(ostream& out, const Token& token)
 	return token.print(out);
 }
 
-string lastline;
-
-bool ascSymbol(int ch)
-{
-	return string("!#$%&*+./<=>?@\\^|-~:").find(ch)!=string::npos;
-}
 int line_number = 0;
 struct Error {
 	int line;
 	string msg;
 	Error(int line, const string& msg) : line(line), msg(msg) {}
 };
+/*
+ * Character classes, one table lookup per character. A name starts with
+ * a letter or _ and goes on with letters, digits, ' and #. Currently I am
+ * recognizing # as a member of the set of characters that can be in a
+ * varid or conid, in order to play with emulating the Haskell magic hash
+ * feature. The character really belongs to the ascSymbol set.
+ */
+enum CharClass {
+	CC_SPACE = 1, CC_NAME_START = 2, CC_NAME = 4, CC_UPPER = 8,
+	CC_DIGIT = 16, CC_SYMBOL = 32, CC_SPECIAL = 64
+};
+struct CharClasses {
+	unsigned char of[256];
+	CharClasses() : of()
+	{
+		for (const char* c = " \t\r"; *c; ++c)
+			of[(unsigned char)*c] |= CC_SPACE;
+		for (int c = 'a'; c <= 'z'; ++c)
+			of[c] |= CC_NAME_START | CC_NAME;
+		for (int c = 'A'; c <= 'Z'; ++c)
+			of[c] |= CC_NAME_START | CC_NAME | CC_UPPER;
+		of['_'] |= CC_NAME_START | CC_NAME;
+		for (int c = '0'; c <= '9'; ++c)
+			of[c] |= CC_DIGIT | CC_NAME;
+		of['\''] |= CC_NAME;
+		of['#'] |= CC_NAME;
+		for (const char* c = "!#$%&*+./<=>?@\\^|-~:"; *c; ++c)
+			of[(unsigned char)*c] |= CC_SYMBOL;
+		for (const char* c = "();,[]`{}"; *c; ++c)
+			of[(unsigned char)*c] |= CC_SPECIAL;
+	}
+	bool is(char c, int cls) const { return of[(unsigned char)c] & cls; }
+};
+static const CharClasses char_class;
+bool ascSymbol(int ch)
+{
+	return char_class.is(ch, CC_SYMBOL);
+}
+/*
+ * The lexer works on the whole source in memory, so a token's text is a
+ * slice of the source rather than a copy. It keeps the line it is on as
+ * a range [p, eol) and steps to the next line when that is used up.
+ */
+class Lexer {
+public:
+	Lexer(const char* begin, const char* end)
+		: p(begin), eol(begin), line_start(begin), next_line(begin), end(end) {}
+	Token next();
+private:
+	bool IndentDedentHandling(Token& inferred);
+	bool ExplicitBlocking(Token& inferred);
+	bool InferSemicolons(Token& inferred);
+	void read_line();
+	bool comment() const;
+	void skip_blanks();
+	Token token(TokenType type, const char* start);
+	const char* p; // the next character of the current line
+	const char* eol;
+	const char* line_start;
+	const char* next_line; // or null at the end of the source
+	const char* end;
+	list<int> columns;
+	enum { BLANK, NEED_SEMI, HAD_SEMI, HAD_OPERATOR } semi_status = BLANK;
+	int parens = 0;
+};
+void Lexer::read_line()
+{
+	p = line_start = next_line;
+	eol = (const char*)memchr(p, '\n', end - p);
+	if (!eol)
+		eol = end;
+	next_line = eol < end ? eol + 1 : nullptr;
+	line_number++;
+}
+// If there is a third character, and the three characters would make a
+// legal 'symbol' token, then the two dashes do not start a comment,
+// except of course that three dashes would start a comment.
+bool Lexer::comment() const
+{
+	return eol - p > 1 && p[0] == '-' && p[1] == '-'
+		&& (eol - p < 3 || p[2] == '-' || !ascSymbol(p[2]));
+}
+void Lexer::skip_blanks()
+{
+	while (p < eol && char_class.is(*p, CC_SPACE))
+		++p;
+}
+Token Lexer::token(TokenType type, const char* start)
+{
+	Token token(type);
+	token.text = string_view(start, p - start);
+	token.line = line_number;
+	token.column = start - line_start + 1;
+	return token;
+}
 /*
  * An implementation of basically the Python indent system.
  * Not really needed for the language I'm parsing because there
  * are no blocks. With a case block or a let/where block this would be
  * handy.
- * This system may do things redundantly. The alternative would be
- * to use a token buffer to help insert the inferred tokens.
  * Contrast with Haskell:
  * Haskell wants an opening curly brace after certain keywords, such as
  * the 'where' at the beginning of a module. Either the user provides
@@ -102,119 +206,73 @@ struct Error {
  * dedent are completely separate tokens. So indentation is obligatory
  * in Python, while Haskell is okay with explicit curly braces.
  */
-list<int> columns;
-bool IndentDedentHandling(istream& in, Token& inferred)
+bool Lexer::IndentDedentHandling(Token& inferred)
 {
-	static int column = 0;
-	static bool newline_done = false;
 	if (columns.empty())
 		columns.push_back(0);
-
-	while (in.good())
+	for (;;)
 	{
-		while (lastline.size()==0 && in.good())
+		if (p == eol)
 		{
-			std::getline(in, lastline);
-			line_number++;
-			column = 0;
-			newline_done = false;
+			if (!next_line)
+				return false;
+			read_line();
 		}
-		size_t nblank = lastline.find_first_not_of(" \t\r");
-		if (nblank != std::string::npos)
+		bool line_begins = p == line_start;
+		skip_blanks();
+		if (p == eol || comment())
 		{
-			int indent = 0;
-			for (int i=0; i<nblank; ++i)
-			{
-				if (lastline[i]=='\t')
-				{
-					indent = indent+(8-indent%8);
-				}
-				else
-				{
-					indent++;
-				}
-			}
-			column = indent;
-			if (column != columns.back())
+			p = eol;
+			continue;
+		}
+		if (line_begins)
+		{
+			int column = 0;
+			for (const char* c = line_start; c < p; ++c)
+				column = *c == '\t' ? column+(8-column%8) : column+1;
+			if (column > columns.back())
 			{
-				if (column > columns.back())
-				{
-					columns.push_back(column);
-					inferred = Token(TT_INDENT);
-					return true;
-				}
-				if (column < columns.back())
-				{
-					auto instack = std::find(columns.begin(), columns.end(), column);
-					if (instack == columns.end())
-					{
-						throw Error(line_number,"Bad indent");
-					}
-					columns.pop_back();
-					inferred = Token(TT_OUTDENT);
-					return true;
-				}
+				columns.push_back(column);
+				inferred = token(TT_INDENT, p);
+				return true;
 			}
-			lastline.erase(0,nblank);
-			if (lastline.size()>1 && (lastline[0]=='-' && lastline[1]=='-'))
+			if (column < columns.back())
 			{
-				// If there is a third character,
-				// and the three characters would make a legal 'symbol' token, then
-				// the two dashes do not start a comment, except of course that
-				// three dashes would start a comment.
-				if (lastline.size()<3 || lastline[2]=='-' || !ascSymbol(lastline[2]))
-				{
-					lastline.clear();
-					continue;
-				}
+				if (std::find(columns.begin(), columns.end(), column) == columns.end())
+					throw Error(line_number,"Bad indent");
+				columns.pop_back();
+				// measure the line again for the next level
+				p = line_start;
+				inferred = token(TT_OUTDENT, p);
+				return true;
 			}
-			break;
-		}
-		else
-		{
-			lastline.clear();
 		}
+		return false;
 	}
-	return false;
 }
 /*
  * This system doesn't guess anything.
  * No blocks with indent-dedent.
  * No semicolons except the ones in the text.
  */
-bool ExplicitBlocking(istream& in, Token&)
+bool Lexer::ExplicitBlocking(Token&)
 {
-	while (in.good())
+	for (;;)
 	{
-		while (lastline.size()==0 && in.good())
-		{
-			std::getline(in, lastline);
-			line_number++;
-		}
-		size_t nblank = lastline.find_first_not_of(" \t\r");
-		if (nblank != std::string::npos)
+		if (p == eol)
 		{
-			lastline.erase(0,nblank);
-			if (lastline.size()>1 && (lastline[0]=='-' && lastline[1]=='-'))
-			{
-				// If there is a third character,
-				// and the three characters would make a legal 'symbol' token, then
-				// the two dashes do not start a comment, except of course that
-				// three dashes would start a comment.
-				if (lastline.size()<3 || lastline[2]=='-' || !ascSymbol(lastline[2]))
-				{
-					lastline.clear();
-					continue;
-				}
-			}
-			break;
+			if (!next_line)
+				return false;
+			read_line();
 		}
-		else
+		skip_blanks();
+		if (p == eol || comment())
 		{
-			lastline.clear();
+			p = eol;
+			continue;
 		}
+		return false;
 	}
-	return false;
 }
 /*
  * This system infers semicolons. There are basically two rules.
@@ -226,84 +284,50 @@ bool ExplicitBlocking(istream& in, Token&)
  * therefore need to prevent a semicolon right next to them.
  * Additionally, blank lines after a semicolon don't call for inferred
  * semicolons.
- * This system may do things redundantly. The alternative would be
- * to use a token buffer to help insert the inferred tokens.
  */
-bool InferSemicolons(istream& in, Token& inferred)
+bool Lexer::InferSemicolons(Token& inferred)
 {
 	/*
 	 * If we run out of characters in the line, then it
 	 * may be time for a semicolon. If the last token off
 	 * the line was a semicolon, then one is not needed.
 	 */
-	enum { BLANK, NEED_SEMI, HAD_SEMI, HAD_OPERATOR };
-	static int semi_status = BLANK;
-	static int parens = 0;
-	//LOG("Entry semi_status = " << (semi_status==BLANK?"BLANK":(semi_status==NEED_SEMI?"NEED_SEMI":"HAD_SEMI")));
-	while (in.good())
+	for (;;)
 	{
-		while (lastline.size()==0 && in.good())
+		if (p == eol)
 		{
-			//LOG("EOL semi_status = " << (semi_status==BLANK?"BLANK":(semi_status==NEED_SEMI?"NEED_SEMI":"HAD_SEMI")));
 			if (semi_status == NEED_SEMI && parens==0)
 			{
-				inferred = Token(TT_SEMI);
+				inferred = token(TT_SEMI, p);
 				semi_status = HAD_SEMI;
 				return true;
 			}
-			std::getline(in, lastline);
+			if (!next_line)
+				return false;
+			read_line();
 			semi_status = BLANK;
-			line_number++;
 		}
-		size_t nblank = lastline.find_first_not_of(" \t\r");
-		if (nblank != std::string::npos)
+		skip_blanks();
+		if (p == eol || comment())
 		{
-			lastline.erase(0,nblank);
-			if (lastline.size()>1 && (lastline[0]=='-' && lastline[1]=='-'))
-			{
-				// If there is a third character,
-				// and the three characters would make a legal 'symbol' token, then
-				// the two dashes do not start a comment, except of course that
-				// three dashes would start a comment.
-				if (lastline.size()<3 || lastline[2]=='-' || !ascSymbol(lastline[2]))
-				{
-					lastline.clear();
-					//LOG("comment semi_status = " << (semi_status==BLANK?"BLANK":(semi_status==NEED_SEMI?"NEED_SEMI":"HAD_SEMI")));
-					if (semi_status == NEED_SEMI && parens==0)
-					{
-						inferred = Token(TT_SEMI);
-						return true;
-					}
-					continue;
-				}
-			}
-			//LOG("Non-EOL (" << lastline << ") semi_status = " << (semi_status==BLANK?"BLANK":(semi_status==NEED_SEMI?"NEED_SEMI":"HAD_SEMI")));
-			break;
-		}
-		else
-		{
-			lastline.clear();
-			//LOG("EOL semi_status = " << (semi_status==BLANK?"BLANK":(semi_status==NEED_SEMI?"NEED_SEMI":"HAD_SEMI")));
-			if (in.good() && semi_status == NEED_SEMI && parens==0)
-			{
-				inferred = Token(TT_SEMI);
-				return true;
-			}
+			p = eol;
+			continue;
 		}
+		break;
 	}
-	if (lastline[0]==';' && parens==0)
+	if (*p==';' && parens==0)
 		semi_status = HAD_SEMI;
-	else if (lastline[0]=='(')
+	else if (*p=='(')
 	{
 		parens++;
 		semi_status = NEED_SEMI;
 	}
-	else if (lastline[0]==')')
+	else if (*p==')')
 	{
 		parens--;
 		semi_status = NEED_SEMI;
 	}
-	else if (lastline[0]=='=')
+	else if (*p=='=')
 	{
 		semi_status = HAD_OPERATOR;
 	}
@@ -311,86 +335,88 @@ bool InferSemicolons(istream& in, Token& inferred)
 		semi_status = NEED_SEMI;
 	return false;
 }
-Token getToken(istream& in)
+Token Lexer::next()
 {
-	static bool newline_done = false;
-
 	Token inferred;
 #if 1
-	if (InferSemicolons(in, inferred))
+	if (InferSemicolons(inferred))
 		return inferred;
 #elif 1
-	if (IndentDedentHandling(in, inferred))
+	if (IndentDedentHandling(inferred))
 		return inferred;
 #else
-	if (ExplicitBlocking(in, inferred))
+	if (ExplicitBlocking(inferred))
 		return inferred;
 #endif
-	if (!in.good())
-		return Token(TT_EOF);
-	if (isalpha(lastline[0]) || lastline[0]=='_')
+	const char* start = p;
+	if (p == eol)
+		return token(TT_EOF, start);
+	if (char_class.is(*p, CC_NAME_START))
 	{
 		//
 		// I am dividing the names into variable names and constructor
 		// names because in the future there will be constructors.
 		// I am not implementing qualified names because I'm not
 		// implementing modules.
-		// Currently I am recognizing # as a member of the set of
-		// characters that can be in a varid or conid, in order to
-		// play with emulating the Haskell magic hash feature.
-		// The character really belongs to the ascSymbol set, which
-		// is a subset of symbol.
 		//
-		size_t nname = lastline.find_first_not_of("abcdefghijklmnopqurstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ_0123456789'#",1);
-		Token id;
-		if (isupper(lastline[0]))
-			id = Token(TT_CONID);
-		else
-			id = Token(TT_VARID);
-		id.text = lastline.substr(0,nname);
+		while (++p < eol && char_class.is(*p, CC_NAME))
+			;
+		Token id = token(char_class.is(*start, CC_UPPER) ? TT_CONID : TT_VARID, start);
 		if (id.text == "data")
-			id = Token(TT_DATA);
+			id.type = TT_DATA;
 		else if (id.text == "case")
-			id = Token(TT_CASE);
+			id.type = TT_CASE;
 		else if (id.text == "of")
-			id = Token(TT_OF);
-		lastline.erase(0,nname);
+			id.type = TT_OF;
+		else if (id.text == "let")
+			id.type = TT_LET;
+		else if (id.text == "letrec")
+			id.type = TT_LETREC;
+		else if (id.text == "in")
+			id.type = TT_IN;
 		return id;
 	}
-	if (isdigit(lastline[0]))
+	if (char_class.is(*p, CC_DIGIT))
 	{
-		size_t ndigits = lastline.find_first_not_of("0123456789",1);
-		Token num;
-		if (lastline[ndigits]=='.' && isdigit(lastline[ndigits+1]))
+		long long ival = 0;
+		bool too_big = false; // only an error if this is not a double
+		for (; p < eol && char_class.is(*p, CC_DIGIT); ++p)
 		{
-			num = Token(TT_DOUBLE);
-			ndigits = lastline.find_first_not_of("0123456789", ndigits+1);
-			num.dval = atof(lastline.c_str());
+			int digit = *p - '0';
+			if (ival > (LLONG_MAX - digit) / 10)
+				too_big = true;
+			else
+				ival = 10*ival + digit;
 		}
-		else
+		if (eol - p > 1 && *p=='.' && char_class.is(p[1], CC_DIGIT))
 		{
-			num = Token(TT_INTEGER);
-			num.ival = atoi(lastline.c_str());
+			for (++p; p < eol && char_class.is(*p, CC_DIGIT); ++p)
+				;
+			Token num = token(TT_DOUBLE, start);
+			num.dval = atof(string(num.text).c_str());
+			return num;
 		}
-		lastline.erase(0,ndigits);
+		if (too_big)
+			throw Error(line_number, "integer literal out of range");
+		Token num = token(TT_INTEGER, start);
+		num.ival = ival;
 		return num;
 	}
-	if (lastline[0]=='"')
+	if (*p=='"')
 	{
-		// Might be hokey.
-		// Not de-escaping the characters ?
-		// Not letting string cross to next line?
-		size_t k=0;
-		for (k=1; k<lastline.length(); ++k)
-		{
-			if (lastline[k]=='"')
-				break;
-			if (lastline[k]=='\\')
-				++k;
-		}
-		Token str(TT_STRING);
-		str.text = lastline.substr(1,k-1);
-		lastline.erase(0,k+1);
+		// Not de-escaping the characters here; the constant pool does
+		// that. A string does not cross to the next line.
+		for (++p; p < eol && *p != '"'; ++p)
+			if (*p=='\\' && p+1 < eol)
+			{
+				++p;
+				if (*p == 'x' && (p+1 == eol || !isxdigit((unsigned char)p[1])))
+					throw Error(line_number, "\\x in a string needs a hex digit");
+			}
+		Token str = token(TT_STRING, start);
+		str.text = string_view(start+1, p - start - 1);
+		if (p < eol)
+			++p;
 		return str;
 	}
 	/*
@@ -401,23 +427,18 @@ Token getToken(istream& in)
 	 * function name into a binary operator, which would matter if the
 	 * syntax level has operator precedence instead of prefix notation.
 	 * (see varop in Haskell) Curly braces are used to bracket blocks of
-	 * declarations. We're not parsing such things right now.
+	 * declarations.
 	 */
-	if (string("();,[]`{}").find(lastline[0]) != string::npos)
+	if (char_class.is(*p, CC_SPECIAL))
 	{
-		auto ch = lastline[0];
-		lastline.erase(0,1);
-		switch (ch)
+		++p;
+		switch (*start)
 		{
-		case '(': return Token(TT_LPAREN);
-		case ')': return Token(TT_RPAREN);
-		case ';': return Token(TT_SEMI);
-		default:
-			break;
+		case '(': return token(TT_LPAREN, start);
+		case ')': return token(TT_RPAREN, start);
+		case ';': return token(TT_SEMI, start);
+		default: return token(TT_OPER, start);
 		}
-		Token oper(TT_OPER);
-		oper.text = string(1,ch);
-		return oper;
 	}
 	/*
 	 * Set symbol. This bunch of characters consists of characters that
@@ -428,14 +449,13 @@ Token getToken(istream& in)
 	 * the third character of the sequence is not a symbol, because
 	 * those three characters would be the first three characters of a
 	 * varsym. The -- sequence followed by a nonsymbol is detected in
-	 * the indentation handler.
+	 * the layout handling.
 	 */
-	size_t nchrs = lastline.find_first_not_of("!#$%&*+./<=>?@\\^|-~:");
-	if (nchrs != 0)
+	if (char_class.is(*p, CC_SYMBOL))
 	{
-		Token oper(TT_OPER);
-		oper.text = lastline.substr(0,nchrs);
-		lastline.erase(0,nchrs);
+		while (++p < eol && char_class.is(*p, CC_SYMBOL))
+			;
+		Token oper = token(TT_OPER, start);
 		if (oper.text == "=")
 			oper.type = TT_EQUALS;
 		else if (oper.text == "|")
@@ -446,31 +466,119 @@ Token getToken(istream& in)
 			oper.type = TT_ARROW_FROM;
 		return oper;
 	}
-	throw Error(line_number, string("bad chrs ")+lastline);
+	throw Error(line_number, "bad chrs " + string(p, eol));
+}
+/*
+ * The source, mapped into memory when it is a regular file and read
+ * whole otherwise.
+ */
+class Source {
+public:
+	Source(const char* path);
+	~Source();
+	const char* begin() const { return data; }
+	const char* end() const { return data + size; }
+private:
+	const char* data;
+	size_t size;
+	bool mapped;
+	string text;
+};
+Source::Source(const char* path) : data(""), size(0), mapped(false)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		throw Error(0, string("cannot open ") + path);
+	struct stat st;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+	{
+		void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map != MAP_FAILED)
+		{
+			data = (const char*)map;
+			size = st.st_size;
+			mapped = true;
+		}
+	}
+	if (!mapped)
+	{
+		char buffer[65536];
+		for (ssize_t n; (n = read(fd, buffer, sizeof buffer)) > 0; )
+			text.append(buffer, n);
+		data = text.data();
+		size = text.size();
+	}
+	close(fd);
+}
+Source::~Source()
+{
+	if (mapped)
+		munmap((void*)data, size);
 }
 struct Parser {
+	Parser(const Source& source) : lexer(source.begin(), source.end()) {}
+	Parser(const char* begin, const char* end) : lexer(begin, end) {}
 	Token token;
-	void next(istream& in)
+	Lexer lexer;
+	void next()
 	{
-		token = getToken(in);
+		token = lexer.next();
 	}
 };
-class Environment
+/*
+ * Interned names. Each identifier the parser keeps is stored once, along
+ * with its C spelling, and a Name is a pointer to that entry. Names
+ * compare and hash as pointers, and c_id() is worked out once per name.
+ * The parser interns nearly all of them. The table is split in shards,
+ * each with its own lock, so the threads that generate code do not queue
+ * behind one another for the few they look up.
+ */
+struct NameEntry {
+	string text;
+	string c_id; // usable in a C identifier
+	string global; // &sc_<c_id>
+};
+class Name
 {
 public:
-	Environment(const vector<string>& args) : args(args) {}
-	void set_arguments(const vector<string>& args_) { args = args_; }
-	string lookup(const string& name) const;
-	void bind_reg(const string& name, int reg_id);
+	Name() : entry(nothing()) {}
+	Name(string_view text) : entry(intern(text)) {}
+	Name(const string& text) : entry(intern(text)) {}
+	Name(const char* text) : entry(intern(text)) {}
+	operator const string&() const { return entry->text; }
+	const string& str() const { return entry->text; }
+	const string& c_id() const { return entry->c_id; }
+	const string& global() const { return entry->global; }
+	bool empty() const { return entry->text.empty(); }
+	bool operator==(Name other) const { return entry == other.entry; }
+	bool operator!=(Name other) const { return entry != other.entry; }
+	bool operator==(const char* text) const { return entry->text == text; }
+	bool operator!=(const char* text) const { return entry->text != text; }
+	bool operator<(Name other) const { return entry->text < other.entry->text; }
+	size_t hash() const { return std::hash<const void*>()(entry); }
 private:
-	vector<string> args;
-	map<string, int> reg_ids;
+	const NameEntry* entry;
+	static const NameEntry* intern(string_view text);
+	static const NameEntry* nothing()
+	{
+		static const NameEntry* entry = intern("");
+		return entry;
+	}
 };
-void Environment::bind_reg(const string& name, int reg_id)
+namespace std {
+template <> struct hash<Name> {
+	size_t operator()(Name name) const { return name.hash(); }
+};
+}
+ostream& operator<<(ostream& out, Name name)
 {
-	reg_ids[name] = reg_id;
+	return out << name.str();
 }
-string c_id(const string& id)
+string operator+(const string& left, Name right) { return left + right.str(); }
+string operator+(const char* left, Name right) { return left + right.str(); }
+string operator+(Name left, const string& right) { return left.str() + right; }
+string operator+(Name left, const char* right) { return left.str() + right; }
+static string encode_c_id(string_view id)
 {
 	ostringstream r;
 	r << std::hex;// << std::setw(2);
@@ -480,68 +588,358 @@ string c_id(const string& id)
 		else
 			r << (unsigned)pid;
 	return r.str();
-
 }
-string Environment::lookup(const string& name) const
+const NameEntry* Name::intern(string_view text)
+{
+	struct Shard {
+		mutex lock;
+		deque<NameEntry> entries;
+		unordered_map<string_view, const NameEntry*> table;
+	};
+	static const size_t SHARDS = 16;
+	static Shard shards[SHARDS];
+	Shard& shard = shards[std::hash<string_view>()(text) % SHARDS];
+	lock_guard<mutex> lock(shard.lock);
+	auto i_entry = shard.table.find(text);
+	if (i_entry != shard.table.end())
+		return i_entry->second;
+	shard.entries.push_back({ string(text), encode_c_id(text), "" });
+	NameEntry& entry = shard.entries.back();
+	entry.global = "&sc_" + entry.c_id;
+	shard.table.emplace(entry.text, &entry);
+	return &entry;
+}
+const string& c_id(Name id)
+{
+	return id.c_id();
+}
+/*
+ * The names in scope while generating a function: its arguments and the
+ * locals bound to registers, which hide arguments of the same name. Each
+ * name maps straight to its slot. A Scope takes back the bindings made
+ * while it lasts, so case alternatives and lets share one table instead
+ * of copying it. A local also counts the reads of it still to come on
+ * the path being generated, so that its register can be cleared after
+ * the last one.
+ */
+class Environment
+{
+public:
+	explicit Environment(const vector<Name>& args);
+	string lookup(Name name) const;
+	bool bound(Name name) const;
+	int argument(Name name) const;
+	void bind_reg(Name name, int reg_id, int uses);
+	int use(Name name);
+	vector<pair<Name, int>> pending() const;
+	int expect(Name name, int uses);
+	class Scope
+	{
+	public:
+		Scope(Environment& env) : env(env), mark(env.undo.size()) {}
+		~Scope() { env.restore(mark); }
+	private:
+		Environment& env;
+		size_t mark;
+	};
+private:
+	struct Slot {
+		int arg; // index in args, or -1
+		int reg; // register, or -1
+		int uses; // reads of the register still to come
+	};
+	unordered_map<Name, Slot> slots;
+	// a name's slot before each bind_reg, arg -2 if it had none
+	vector<pair<Name, Slot>> undo;
+	void restore(size_t mark);
+};
+Environment::Environment(const vector<Name>& args)
+{
+	// the first of two arguments with one name wins
+	for (int i=0; i<args.size(); ++i)
+		slots.insert({ args[i], { i, -1, 0 } });
+}
+void Environment::bind_reg(Name name, int reg_id, int uses)
 {
-	auto i_arg = find(args.begin(), args.end(), name);
-	ostringstream os;
-	if (i_arg != args.end())
+	auto i_slot = slots.find(name);
+	if (i_slot == slots.end())
 	{
-		auto index = distance(args.begin(), i_arg);
-		os << "args[" << index << ']';
-		//out << "    comp_t *e" << n << " = args[" << index << "]; /* " << id << "*/" << endl;
+		undo.push_back({ name, { -2, -1, 0 } });
+		slots.insert({ name, { -1, reg_id, uses } });
 	}
 	else
 	{
-		//out << "    comp_t *e" << n << " = &sc_" << id << "; /* " << id << "*/" <<endl;
-		auto i_reg_bind = reg_ids.find(name);
-		if (i_reg_bind != reg_ids.end())
-			os << "e" << (*i_reg_bind).second;
+		undo.push_back(*i_slot);
+		i_slot->second.reg = reg_id;
+		i_slot->second.uses = uses;
+	}
+}
+// Counts a read of name. The register it is in if that was the last
+// read on this path, else -1.
+int Environment::use(Name name)
+{
+	auto i_slot = slots.find(name);
+	if (i_slot == slots.end() || i_slot->second.reg < 0 || i_slot->second.uses <= 0)
+		return -1;
+	return --i_slot->second.uses == 0 ? i_slot->second.reg : -1;
+}
+// the locals in registers that are still to be read, and how often
+vector<pair<Name, int>> Environment::pending() const
+{
+	vector<pair<Name, int>> locals;
+	for (auto& [name, slot] : slots)
+		if (slot.reg >= 0 && slot.uses > 0)
+			locals.push_back({ name, slot.uses });
+	return locals;
+}
+// Sets how often a local is still to be read, on a path that branches
+// off. Its register if it is not read any more, else -1.
+int Environment::expect(Name name, int uses)
+{
+	Slot& slot = slots.at(name);
+	slot.uses = uses;
+	return uses == 0 ? slot.reg : -1;
+}
+void Environment::restore(size_t mark)
+{
+	while (undo.size() > mark)
+	{
+		auto& [name, slot] = undo.back();
+		if (slot.arg == -2)
+			slots.erase(name);
 		else
-			os << "&sc_" << c_id(name);
+			slots[name] = slot;
+		undo.pop_back();
+	}
+}
+// true when name is an argument or a local, hiding any global
+bool Environment::bound(Name name) const
+{
+	return slots.count(name);
+}
+// the index of the argument name refers to, or -1
+int Environment::argument(Name name) const
+{
+	auto i_slot = slots.find(name);
+	if (i_slot == slots.end() || i_slot->second.reg >= 0)
+		return -1;
+	return i_slot->second.arg;
+}
+// A pattern variable hides an argument of the same name.
+string Environment::lookup(Name name) const
+{
+	auto i_slot = slots.find(name);
+	if (i_slot == slots.end())
+		return name.global();
+	const Slot& slot = i_slot->second;
+	if (slot.reg >= 0)
+		return "e" + to_string(slot.reg);
+	return "args[" + to_string(slot.arg) + "]";
+}
+/*
+ * The syntax tree is bump-allocated. Nodes, definitions and the types
+ * and functions they hold are taken from large chunks and never freed
+ * one by one; the chunks go when the program exits.
+ */
+class Arena {
+public:
+	~Arena()
+	{
+		for (auto chunk : chunks)
+			free(chunk);
+	}
+	void* allocate(size_t size)
+	{
+		const size_t align = alignof(max_align_t);
+		size = (size + align - 1) & ~(align - 1);
+		if (size > room)
+		{
+			size_t bytes = max(size, CHUNK);
+			next = static_cast<char*>(malloc(bytes));
+			if (next == nullptr)
+				throw bad_alloc();
+			chunks.push_back(next);
+			room = bytes;
+		}
+		void* p = next;
+		next += size;
+		room -= size;
+		return p;
 	}
-	return os.str();
+private:
+	static constexpr size_t CHUNK = 1 << 20;
+	vector<char*> chunks;
+	char* next = nullptr;
+	size_t room = 0;
+};
+static Arena ast_arena;
+struct ArenaObject {
+	static void* operator new(size_t size) { return ast_arena.allocate(size); }
+	static void operator delete(void*) {}
+};
+/*
+ * What a node holds instead of a vector: its elements in the arena and
+ * their count. It grows by doubling and leaves the old array behind, and
+ * copying one copies the elements. Having no destructor, it lets the
+ * nodes go without one too, which is what never freeing them needs.
+ */
+template <class T> class ArenaVector {
+	static_assert(is_trivially_destructible_v<T>, "arena elements are never destroyed");
+public:
+	ArenaVector() {}
+	ArenaVector(const ArenaVector& other) { append(other.begin(), other.end()); }
+	ArenaVector(const vector<T>& other) { append(other.begin(), other.end()); }
+	ArenaVector(initializer_list<T> other) { append(other.begin(), other.end()); }
+	ArenaVector& operator=(const ArenaVector& other)
+	{
+		if (this != &other)
+		{
+			count = 0;
+			append(other.begin(), other.end());
+		}
+		return *this;
+	}
+	T* begin() { return items; }
+	T* end() { return items + count; }
+	const T* begin() const { return items; }
+	const T* end() const { return items + count; }
+	reverse_iterator<T*> rbegin() { return reverse_iterator<T*>(end()); }
+	reverse_iterator<T*> rend() { return reverse_iterator<T*>(begin()); }
+	reverse_iterator<const T*> rbegin() const { return reverse_iterator<const T*>(end()); }
+	reverse_iterator<const T*> rend() const { return reverse_iterator<const T*>(begin()); }
+	size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+	T& operator[](size_t i) { return items[i]; }
+	const T& operator[](size_t i) const { return items[i]; }
+	T& front() { return items[0]; }
+	T& back() { return items[count - 1]; }
+	const T& back() const { return items[count - 1]; }
+	void push_back(const T& item)
+	{
+		reserve(count + 1);
+		new (items + count) T(item);
+		++count;
+	}
+	template <class... Args> void emplace_back(Args&&... args)
+	{
+		reserve(count + 1);
+		new (items + count) T{ forward<Args>(args)... };
+		++count;
+	}
+	template <class I> void append(I first, I last)
+	{
+		for (; first != last; ++first)
+			push_back(*first);
+	}
+	template <class I> void assign(I first, I last)
+	{
+		count = 0;
+		append(first, last);
+	}
+	T* erase(T* at)
+	{
+		copy(at + 1, end(), at);
+		--count;
+		return at;
+	}
+	void resize(size_t n)
+	{
+		reserve(n);
+		for (; count < n; ++count)
+			new (items + count) T();
+		count = n;
+	}
+	vector<T> to_vector() const { return vector<T>(begin(), end()); }
+private:
+	void reserve(size_t n)
+	{
+		if (n <= capacity)
+			return;
+		size_t grown = max<size_t>(max<size_t>(n, 2*capacity), 4);
+		T* moved = static_cast<T*>(ast_arena.allocate(grown * sizeof(T)));
+		for (size_t i = 0; i < count; ++i)
+			new (moved + i) T(items[i]);
+		items = moved;
+		capacity = grown;
+	}
+	T* items = nullptr;
+	size_t count = 0, capacity = 0;
+};
+// A string kept as long as the syntax tree.
+static string_view arena_string(string_view text)
+{
+	char* copy = static_cast<char*>(ast_arena.allocate(text.size() + 1));
+	memcpy(copy, text.data(), text.size());
+	copy[text.size()] = '\0';
+	return string_view(copy, text.size());
+}
+// Each kind of node carries its tag, so passes test it instead of
+// asking RTTI.
+enum NodeKind {
+	NK_NUM, NK_VAR, NK_STR, NK_OPERATOR, NK_CTOR, NK_CTORPAT,
+	NK_CASE, NK_LET, NK_FAIL, NK_APPLY, NK_CCALL
+};
+// kind_cast<T>(p) is p as a T if its tag says it is one, else nullptr.
+template <class T, class U> T* kind_cast(U* p)
+{
+	return p != nullptr && p->kind == T::KIND ? static_cast<T*>(p) : nullptr;
+}
+template <class T, class U> const T* kind_cast(const U* p)
+{
+	return p != nullptr && p->kind == T::KIND ? static_cast<const T*>(p) : nullptr;
 }
-struct Node {
-	virtual ostream& print(ostream& out) const { return out; }
-	virtual int output_computation(ostream& out, int n, const Environment& env) { return n; }
-	virtual ~Node() {}
+// Nodes have no virtual methods: these switch on the tag to the method of
+// the same name in the node's own struct, see dispatch().
+struct Node : ArenaObject {
+	Node(NodeKind kind) : kind(kind) {}
+	const NodeKind kind;
+	ostream& print(ostream& out) const;
+	int output_computation(ostream& out, int n, Environment& env);
+	// The value is about to be forced, so it may be computed right
+	// away instead of being built as a suspension.
+	int output_strict(ostream& out, int n, Environment& env);
 };
 ostream& operator<<(ostream& out, const Node& node)
 {
 	return node.print(out);
 }
 struct Num : Node {
-	Num(int ivalue) : value(ivalue) {}
-	Num(double dvalue) : value(dvalue) {}
-	ostream& print(ostream& out) const { return out << value; }
-	int output_computation(ostream& out, int n, const Environment& env);
+	static const NodeKind KIND = NK_NUM;
+	Num(long long ivalue) : Node(KIND), integer(true), ivalue(ivalue), value(ivalue) {}
+	Num(double dvalue) : Node(KIND), integer(false), ivalue(0), value(dvalue) {}
+	ostream& print(ostream& out) const { return integer ? out << ivalue : out << value; }
+	int output_computation(ostream& out, int n, Environment& env);
+	bool integer; // the literal was written without a decimal point
+	long long ivalue;
 	double value;
 };
 struct Var : Node {
-	Var(const string& id) : id(id) {}
+	static const NodeKind KIND = NK_VAR;
+	Var(Name id) : Node(KIND), id(id) {}
 	ostream& print(ostream& out) const { return out << id; }
-	int output_computation(ostream& out, int n, const Environment& env);
-	string id;
+	int output_computation(ostream& out, int n, Environment& env);
+	Name id;
 };
 struct Str : Node {
-	Str(const string& text) : text(text) {}
+	static const NodeKind KIND = NK_STR;
+	Str(string_view text) : Node(KIND), text(arena_string(text)) {}
 	ostream& print(ostream& out) const { return out << '"' <<  text << '"'; }
-	int output_computation(ostream& out, int n, const Environment& env);
-	string text;
+	int output_computation(ostream& out, int n, Environment& env);
+	string_view text;
 };
 struct Operator : Node {
-	Operator(const string& id) : id(id) {}
-	string id;
+	static const NodeKind KIND = NK_OPERATOR;
+	Operator(Name id) : Node(KIND), id(id) {}
+	Name id;
 	ostream& print(ostream& out) const { return out << id; }
-	int output_computation(ostream& out, int n, const Environment& env);
+	int output_computation(ostream& out, int n, Environment& env);
 };
 struct Ctor : Node {
-	Ctor(const string& id) : id(id) {}
-	string id; // Not Bool but True or False. Not List but Cons or Nil
-	vector<Node*> arguments;
-	int output_computation(ostream& out, int n, const Environment& env);
+	static const NodeKind KIND = NK_CTOR;
+	Ctor(Name id) : Node(KIND), id(id) {}
+	Name id; // Not Bool but True or False. Not List but Cons or Nil
+	ArenaVector<Node*> arguments;
+	int output_computation(ostream& out, int n, Environment& env);
 	ostream& print(ostream& out) const
 	{
 		out << id;
@@ -555,10 +953,11 @@ struct Ctor : Node {
 	}
 };
 struct CtorPat : Node {
-	CtorPat(const string& id) : id(id) {}
-	string id; // Not Bool but True or False. Not List but Cons or Nil
-	vector<string> arguments;
-	int output_computation(ostream& out, int n, const Environment& env);
+	static const NodeKind KIND = NK_CTORPAT;
+	CtorPat(Name id) : Node(KIND), id(id) {}
+	Name id; // Not Bool but True or False. Not List but Cons or Nil
+	ArenaVector<Name> arguments;
+	int output_computation(ostream& out, int n, Environment& env);
 	ostream& print(ostream& out) const
 	{
 		out << id;
@@ -572,15 +971,16 @@ struct CtorPat : Node {
 	}
 };
 struct Case : Node {
-	Case(Node* scrutinee) : scrutinee(scrutinee) {}
+	static const NodeKind KIND = NK_CASE;
+	Case(Node* scrutinee) : Node(KIND), scrutinee(scrutinee) {}
 	Node* scrutinee;
 	struct PatExpr {
 		Node* pat;
 		Node* expr;
 	};
-	typedef list<PatExpr> PatExprs;
+	typedef ArenaVector<PatExpr> PatExprs;
 	PatExprs patExprs;
-	int output_computation(ostream& out, int n, const Environment& env);
+	int output_computation(ostream& out, int n, Environment& env);
 	ostream& print(ostream& out) const
 	{
 		out << "case " << *scrutinee << " of { " << endl;
@@ -590,24 +990,70 @@ struct Case : Node {
 		return out;
 	}
 };
+// let (or letrec) name = expr; ... in body. Each binding is built once
+// and shared by every use. A let binding can use the bindings before it;
+// the bindings of a letrec can all use each other.
+struct Let : Node {
+	static const NodeKind KIND = NK_LET;
+	Let(bool recursive) : Node(KIND), recursive(recursive), body(nullptr) {}
+	bool recursive;
+	struct Binding {
+		Name name;
+		Node* expr;
+	};
+	ArenaVector<Binding> bindings;
+	Node* body;
+	int output_computation(ostream& out, int n, Environment& env) { return output_let(out, n, env, false); }
+	int output_strict(ostream& out, int n, Environment& env) { return output_let(out, n, env, true); }
+	int output_let(ostream& out, int n, Environment& env, bool strict);
+	ostream& print(ostream& out) const
+	{
+		out << (recursive ? "letrec " : "let ");
+		for (auto binding : bindings)
+			out << binding.name << " = " << *binding.expr << "; ";
+		return out << "in " << *body;
+	}
+};
+// What a case evaluates to when none of its patterns match.
+struct Fail : Node {
+	static const NodeKind KIND = NK_FAIL;
+	Fail() : Node(KIND) {}
+	ostream& print(ostream& out) const { return out << "fail"; }
+	int output_computation(ostream& out, int n, Environment& env);
+};
+// The names a pattern of a compiled case binds: a constructor's
+// variables, or a variable standing for the whole value.
+static vector<Name> pattern_vars(const Node* pat)
+{
+	if (const CtorPat* ctor_pat = kind_cast<CtorPat>(pat))
+		return ctor_pat->arguments.to_vector();
+	if (const Var* var = kind_cast<Var>(pat))
+		return { var->id };
+	return {};
+}
+struct Symbol;
 struct Apply : Node {
+	static const NodeKind KIND = NK_APPLY;
+	Apply() : Node(KIND), to_apply(nullptr) {}
 	// In many implementations of such things, an Apply node
 	// is a pair. But the supercombinator code will want to
 	// recover the arity of the (partial at times) application,
 	// so we may as well retain it.
 	Node* to_apply;
-	vector<Node*> arguments;
+	ArenaVector<Node*> arguments;
 	// For printing, if any of our entities is itself an application,
 	// print parens around it.
 	static ostream& print_bracketed(ostream& out, const Node* term)
 	{
-		bool paren = dynamic_cast<const Apply*>(term) != nullptr;
+		bool paren = kind_cast<Apply>(term) != nullptr;
 		if (paren) out << '(';
 		out << *term;
 		if (paren) out << ')';
 		return out;
 	}
-	int output_computation(ostream& out, int n, const Environment& env);
+	int output_computation(ostream& out, int n, Environment& env);
+	int output_strict(ostream& out, int n, Environment& env);
+	const Symbol* known(Environment& env) const;
 	ostream& print(ostream& out) const
 	{
 		print_bracketed(out, to_apply);// out << *to_apply;
@@ -617,7 +1063,7 @@ struct Apply : Node {
 			out << ' ';
 			print_bracketed(out, *iarg); iarg++;
 #if 0
-			bool paren = dynamic_cast<Apply*>(*iarg) != nullptr;
+			bool paren = kind_cast<Apply>(*iarg) != nullptr;
 			if (paren) out << '(';
 			out << **iarg; iarg++;
 			if (paren) out << ')';
@@ -626,9 +1072,23 @@ struct Apply : Node {
 		return out;
 	}
 };
+// The functions a ccall may name, with the runtime function that
+// implements each one. Those marked integer get their argument forced
+// to an integer, the others receive the computation itself.
+struct CcallFunction {
+	string runtime;
+	bool integer;
+};
+static const map<string, CcallFunction> ccall_functions = {
+	{ "putchar", { "write_char", true } },
+	{ "putstr", { "write_str", false } },
+	{ "putnum", { "write_num", false } },
+};
 struct Ccall : Node {
-	string c_id;
-	vector<Node*> arguments;
+	static const NodeKind KIND = NK_CCALL;
+	Ccall() : Node(KIND) {}
+	Name c_id;
+	ArenaVector<Node*> arguments;
 	ostream& print(ostream& out) const
 	{
 		out << "ccall " << c_id;
@@ -636,51 +1096,167 @@ struct Ccall : Node {
 			out << ' ' << *arg;
 		return out;
 	}
-	int output_computation(ostream& out, int n, const Environment& env);
+	int output_computation(ostream& out, int n, Environment& env);
 };
-class Defineable {
+// node as its own struct, by its tag
+template <class T, class N> using like = conditional_t<is_const_v<N>, const T, T>;
+template <class N, class F> decltype(auto) dispatch(N* node, F&& f)
+{
+	switch (node->kind)
+	{
+	case NK_NUM: return f(static_cast<like<Num, N>*>(node));
+	case NK_VAR: return f(static_cast<like<Var, N>*>(node));
+	case NK_STR: return f(static_cast<like<Str, N>*>(node));
+	case NK_OPERATOR: return f(static_cast<like<Operator, N>*>(node));
+	case NK_CTOR: return f(static_cast<like<Ctor, N>*>(node));
+	case NK_CTORPAT: return f(static_cast<like<CtorPat, N>*>(node));
+	case NK_CASE: return f(static_cast<like<Case, N>*>(node));
+	case NK_LET: return f(static_cast<like<Let, N>*>(node));
+	case NK_FAIL: return f(static_cast<like<Fail, N>*>(node));
+	case NK_APPLY: return f(static_cast<like<Apply, N>*>(node));
+	case NK_CCALL: return f(static_cast<like<Ccall, N>*>(node));
+	}
+	abort();
+}
+ostream& Node::print(ostream& out) const
+{
+	return dispatch(this, [&](auto node) -> ostream& { return node->print(out); });
+}
+int Node::output_computation(ostream& out, int n, Environment& env)
+{
+	return dispatch(this, [&](auto node) { return node->output_computation(out, n, env); });
+}
+int Node::output_strict(ostream& out, int n, Environment& env)
+{
+	if (Apply* apply = kind_cast<Apply>(this))
+		return apply->output_strict(out, n, env);
+	if (Let* let = kind_cast<Let>(this))
+		return let->output_strict(out, n, env);
+	return output_computation(out, n, env);
+}
+enum DefineableKind { DK_TYPE, DK_FUNCTION };
+// Like Node, a Type or a Function by its tag.
+class Defineable : public ArenaObject {
 public:
-	virtual ~Defineable() {}
-	virtual ostream& print(ostream& out) const = 0;
-	virtual void output_function_prototype(ostream& out, const string& id) const = 0;
-	virtual void output_function_info(ostream& out, const string& id) const = 0;
-	virtual void output_function_definition(ostream& out, const string& id) const = 0;
+	Defineable(DefineableKind kind) : kind(kind) {}
+	const DefineableKind kind;
+	ostream& print(ostream& out) const;
+	void output_function_prototype(ostream& out, Name id) const;
+	void output_function_info(ostream& out, Name id) const;
+	void output_function_definition(ostream& out, Name id) const;
+	void output_function_extern(ostream& out, Name id) const;
 };
 struct Constructor {
-	string constructor;
-	vector <string> arguments;
+	Name constructor;
+	ArenaVector<Name> arguments;
 	ostream& print(ostream& out) const;
-	void output_function_prototype(ostream& out, const string& id) const;
-	void output_function_heading(ostream& out, const string& id) const;
-	void output_function_info(ostream& out, const string& id) const;
-	void output_function_definition(ostream& out, const string& id) const;
+	void output_function_prototype(ostream& out, Name id) const;
+	void output_function_heading(ostream& out, Name id) const;
+	void output_function_info(ostream& out, Name id) const;
+	void output_function_definition(ostream& out, Name id) const;
 };
 ostream& operator<<(ostream& out, const Constructor& constructor)
 {
 	return constructor.print(out);
 }
 struct Type : public Defineable {
-	vector <string> arguments;
-	vector <Constructor> constructors;
+	static const DefineableKind KIND = DK_TYPE;
+	Type() : Defineable(KIND) {}
+	ArenaVector<Name> arguments;
+	ArenaVector<Constructor> constructors;
 	ostream& print(ostream& out) const;
-	void output_function_prototype(ostream& out, const string& id) const;
-	void output_function_info(ostream& out, const string& id) const;
-	void output_function_definition(ostream& out, const string& id) const;
+	void output_function_prototype(ostream& out, Name id) const;
+	void output_function_info(ostream& out, Name id) const;
+	void output_function_definition(ostream& out, Name id) const;
+	void output_function_extern(ostream& out, Name id) const;
 };
 struct Function : public Defineable {
-	vector<string> arguments;
+	static const DefineableKind KIND = DK_FUNCTION;
+	Function() : Defineable(KIND), body(nullptr) {}
+	ArenaVector<Name> arguments;
 	Node* body;
 	ostream& print(ostream& out) const;
-	void output_function_prototype(ostream& out, const string& id) const;
-	void output_function_heading(ostream& out, const string& id) const;
-	void output_function_info(ostream& out, const string& id) const;
-	void output_function_definition(ostream& out, const string& id) const;
+	unsigned strict_arguments() const;
+	bool data_result() const;
+	void output_function_prototype(ostream& out, Name id) const;
+	void output_function_heading(ostream& out, Name id) const;
+	void output_function_info(ostream& out, Name id) const;
+	void output_function_definition(ostream& out, Name id) const;
+	void output_function_extern(ostream& out, Name id) const;
+	void output_worker_heading(ostream& out, Name id) const;
+	void output_worker(ostream& out, Name id) const;
 };
-struct Definition {
-	string id;
+template <class D, class F> decltype(auto) dispatch_defineable(D* defineable, F&& f)
+{
+	if (defineable->kind == DK_TYPE)
+		return f(static_cast<like<Type, D>*>(defineable));
+	return f(static_cast<like<Function, D>*>(defineable));
+}
+ostream& Defineable::print(ostream& out) const
+{
+	return dispatch_defineable(this, [&](auto defineable) -> ostream& { return defineable->print(out); });
+}
+void Defineable::output_function_prototype(ostream& out, Name id) const
+{
+	dispatch_defineable(this, [&](auto defineable) { defineable->output_function_prototype(out, id); });
+}
+void Defineable::output_function_info(ostream& out, Name id) const
+{
+	dispatch_defineable(this, [&](auto defineable) { defineable->output_function_info(out, id); });
+}
+void Defineable::output_function_definition(ostream& out, Name id) const
+{
+	dispatch_defineable(this, [&](auto defineable) { defineable->output_function_definition(out, id); });
+}
+void Defineable::output_function_extern(ostream& out, Name id) const
+{
+	dispatch_defineable(this, [&](auto defineable) { defineable->output_function_extern(out, id); });
+}
+struct Definition : ArenaObject {
+	Name id;
+	int line;
 	Defineable* defineable;
+	string_view source; // of a function, while it may go in an interface
+	// read from an interface: compiled elsewhere, with the strictness
+	// and worker it was compiled with
+	bool imported = false;
+	unsigned strict = 0;
+	bool worker = false;
+	bool unused = false; // main does not reach it, see mark_unused
 	ostream& print(ostream& out) const;
 };
+// Nothing in the arena is destroyed, so nothing there may need to be.
+static_assert(is_trivially_destructible_v<Num> && is_trivially_destructible_v<Var>
+	&& is_trivially_destructible_v<Str> && is_trivially_destructible_v<Operator>
+	&& is_trivially_destructible_v<Ctor> && is_trivially_destructible_v<CtorPat>
+	&& is_trivially_destructible_v<Case> && is_trivially_destructible_v<Let>
+	&& is_trivially_destructible_v<Fail> && is_trivially_destructible_v<Apply>
+	&& is_trivially_destructible_v<Ccall> && is_trivially_destructible_v<Type>
+	&& is_trivially_destructible_v<Function> && is_trivially_destructible_v<Definition>, "arena objects need no destructor");
+static_assert(!is_polymorphic_v<Node> && !is_polymorphic_v<Defineable>, "nodes dispatch on their tags");
+/*
+ * Symbol table. Every top-level name with its arity and the C function
+ * behind it, so applications can be checked against their definitions
+ * and saturated calls in strict position can call that function
+ * directly instead of building the application for eval() to reduce.
+ */
+struct Symbol {
+	enum Kind { FUNCTION, CONSTRUCTOR, OPERATOR } kind;
+	int arity;
+	unsigned strict; // arguments the callee always forces
+	string function;
+	const Function* source; // for functions whose body is known
+	bool worker; // has an unboxed worker, see below
+	bool imported; // strict and worker come from an interface
+	bool data = false; // every result is a value nothing can be applied to
+};
+static map<string, Symbol> symbols;
+static thread_local int definition_line; // for errors found while generating code
+static void check_defined(Name id, Environment& env)
+{
+	if (!env.bound(id) && !symbols.count(id))
+		throw Error(definition_line, "undefined name " + id);
+}
 ostream& operator<<(ostream& out, const Defineable& defineable)
 {
 	return defineable.print(out);
@@ -726,7 +1302,26 @@ ostream& Type::print(ostream& out) const
 	}
 	return out;
 }
-void Constructor::output_function_heading(ostream& out, const string& id) const
+/*
+ * Profiling. With --profile every supercombinator and constructor gets a
+ * prof_t record next to its info record, and its body is bracketed with
+ * PROF_ENTER/PROF_LEAVE so the runtime can count what it does.
+ */
+static bool profile;
+void output_profile_record(ostream& out, const string& prefix, const string& id, const string& name)
+{
+	if (!profile)
+		return;
+	out << "prof_t prof_" << prefix << id << " = { \"";
+	for (char c : name)
+	{
+		if (c == '"' || c == '\\')
+			out << '\\';
+		out << c;
+	}
+	out << "\" };" << endl;
+}
+void Constructor::output_function_heading(ostream& out, Name id) const
 {
 	out << "void ctor_" << c_id(constructor) << ' ';
 	out << "(comp_t** result, comp_t** args) /*";
@@ -734,23 +1329,23 @@ void Constructor::output_function_heading(ostream& out, const string& id) const
 		out << arg << " ";
 	out << "*/";
 }
-void Constructor::output_function_info(ostream& out, const string& id) const
+void Constructor::output_function_info(ostream& out, Name id) const
 {
-	out << "comp_t sc_" << c_id(id) << " = { ctor_" << c_id(constructor) << ", " << arguments.size() << "};" << endl;
+	// a nullary constructor is a constant, shared by everyone who uses it
+	if (arguments.empty())
+		out << "comp_t sc_" << c_id(id) << " = { .val = {.tag = " << c_id(constructor) << "}, .type = ct_alg };" << endl;
+	else
+		out << "comp_t sc_" << c_id(id) << " = { ctor_" << c_id(constructor) << ", " << arguments.size() << "};" << endl;
+	output_profile_record(out, "ctor_", c_id(constructor), constructor);
+	// packed strings unpack into Cons cells
+	if (constructor == "Cons")
+		out << "unsigned cons_tag = Cons;" << endl;
 }
-void Constructor::output_function_definition(ostream& out, const string& id) const
+void Constructor::output_function_definition(ostream& out, Name id) const
 {
 
 }
-void Type::output_function_prototype(ostream& out, const string& id) const
-{
-	for (auto ctor : constructors)
-	{
-		ctor.output_function_heading(out, ctor.constructor);
-		out << ';' << endl;
-	}
-}
-void Type::output_function_definition(ostream& out, const string& id) const
+void Type::output_function_prototype(ostream& out, Name id) const
 {
 	out << "enum { " << endl;
 	for (auto ctor : constructors)
@@ -761,24 +1356,42 @@ void Type::output_function_definition(ostream& out, const string& id) const
 	for (auto ctor : constructors)
 	{
 		ctor.output_function_heading(out, ctor.constructor);
-		out << "{" << endl;
-		out << "    *result = constructor("<< c_id(ctor.constructor) << ", " << ctor.arguments.size();
-		for (int arg=0; arg<ctor.arguments.size(); ++arg)
-			out << ", args["<<arg<<']';
+		out << ';' << endl;
+	}
+}
+void Type::output_function_definition(ostream& out, Name id) const
+{
+	for (auto ctor : constructors)
+	{
+		ctor.output_function_heading(out, ctor.constructor);
+		out << "{" << endl;
+		if (profile)
+			out << "    PROF_ENTER(prof_ctor_" << c_id(ctor.constructor) << ");" << endl;
+		out << "    *result = constructor("<< c_id(ctor.constructor) << ", " << ctor.arguments.size();
+		for (int arg=0; arg<ctor.arguments.size(); ++arg)
+			out << ", args["<<arg<<']';
 		out << ");" << endl;
+		if (profile)
+			out << "    PROF_LEAVE();" << endl;
 		//int n = ctor..output_function_definition(out, 0, arguments);
 		//out << "    *result = e" << n << ";" << endl;
 		out << "}" << endl;
 	}
 }
-void Type::output_function_info(ostream& out, const string& id) const
+void Type::output_function_info(ostream& out, Name id) const
 {
 	for (auto ctor : constructors)
 	{
 		ctor.output_function_info(out, ctor.constructor);
 	}
 }
-void Function::output_function_heading(ostream& out, const string& id) const
+// a type from an interface: its constructors are defined by the module
+void Type::output_function_extern(ostream& out, Name id) const
+{
+	for (auto ctor : constructors)
+		out << "extern comp_t sc_" << c_id(ctor.constructor) << ";" << endl;
+}
+void Function::output_function_heading(ostream& out, Name id) const
 {
 	out << "void fun_" << id << ' ';
 	out << "(comp_t** result, comp_t** args) /*";
@@ -786,563 +1399,3234 @@ void Function::output_function_heading(ostream& out, const string& id) const
 		out << arg << " ";
 	out << "*/";
 }
-void Function::output_function_info(ostream& out, const string& id) const
+/*
+ * Strictness analysis. strict_vars() collects the variables an expression
+ * always forces when its value is demanded, and a function is strict in
+ * the arguments its body forces. Recursive definitions are solved by
+ * iteration from "strict in everything", dropping arguments until nothing
+ * changes. eval() reduces strict arguments on its own stack before the
+ * call, and known calls compute them in place.
+ */
+typedef unordered_set<Name> Vars;
+typedef unordered_map<Name, int> Uses; // how often each name is read
+// Adds names to a set of locals while it lasts, then takes out those that
+// were not there before, so a case alternative or a let need not copy the
+// set.
+class LocalScope
 {
-	out << "comp_t sc_" << id << " = { fun_" << id << ", " << arguments.size() << "};" << endl;
+public:
+	LocalScope(Vars& locals) : locals(locals) {}
+	~LocalScope()
+	{
+		for (auto name : added)
+			locals.erase(name);
+	}
+	void add(Name name)
+	{
+		if (locals.insert(name).second)
+			added.push_back(name);
+	}
+private:
+	Vars& locals;
+	vector<Name> added;
+};
+static Name head_id(const Apply* apply)
+{
+	if (Var* var = kind_cast<Var>(apply->to_apply))
+		return var->id;
+	if (Operator* op = kind_cast<Operator>(apply->to_apply))
+		return op->id;
+	return Name();
 }
-void Function::output_function_prototype(ostream& out, const string& id) const
+// the global an application calls, unless a local hides it
+static const Symbol* callee(const Apply* apply, const Vars& locals)
 {
-	output_function_heading(out, id);
-	out << ';' << endl;
+	Name id = head_id(apply);
+	if (id.empty() || locals.count(id))
+		return nullptr;
+	auto i_symbol = symbols.find(id);
+	return i_symbol == symbols.end() ? nullptr : &i_symbol->second;
 }
-int Var::output_computation(ostream& out, int n, const Environment& env)
+// A conditional is a case with True and False alternatives, or a call of
+// a selector like if, whose body is such a case on one argument that
+// returns one of the others.
+struct Cond {
+	const Node* test;
+	const Node* when_true;
+	const Node* when_false;
+};
+static bool true_false(const Case* case_expr, const Node*& when_true, const Node*& when_false)
 {
-	out << "    comp_t *e" << n << " = " << env.lookup(id)<<"; /* " << id << "*/" << endl;
-	return n;
+	when_true = when_false = nullptr;
+	for (auto pat_expr : case_expr->patExprs)
+	{
+		CtorPat* ctor_pat = kind_cast<CtorPat>(pat_expr.pat);
+		if (!ctor_pat || !ctor_pat->arguments.empty())
+			return false;
+		if (ctor_pat->id == "True" && !when_true)
+			when_true = pat_expr.expr;
+		else if (ctor_pat->id == "False" && !when_false)
+			when_false = pat_expr.expr;
+		else
+			return false;
+	}
+	return when_true && when_false;
 }
-int Str::output_computation(ostream& out, int n, const Environment& env)
+static int argument_index(const Function* function, const Node* node)
 {
-	out << "    comp_t *e" << n << " = str(\"" << text << "\");" << endl;
-	return n;
+	const Var* var = kind_cast<Var>(node);
+	if (!var)
+		return -1;
+	auto& arguments = function->arguments;
+	auto i_arg = find(arguments.begin(), arguments.end(), var->id);
+	return i_arg == arguments.end() ? -1 : distance(arguments.begin(), i_arg);
 }
-int Num::output_computation(ostream& out, int n, const Environment& env)
+// Whether a function is a selector like if, with the arguments it tests
+// and returns.
+static bool selector(const Function* function, int& test, int& yes, int& no)
 {
-	out << "    comp_t *e" << n << " = num(" << value << ");" << endl;
-	return n;
+	const Case* case_body = kind_cast<Case>(function->body);
+	const Node *when_true, *when_false;
+	if (!case_body || !true_false(case_body, when_true, when_false))
+		return false;
+	test = argument_index(function, case_body->scrutinee);
+	yes = argument_index(function, when_true);
+	no = argument_index(function, when_false);
+	return test >= 0 && yes >= 0 && no >= 0;
 }
-int Apply::output_computation(ostream& out, int n, const Environment& env)
+static bool as_cond(const Node* node, const Vars& locals, Cond& cond)
 {
-	vector<int> comps;
-	for (int i=0; i<arguments.size(); ++i)
+	if (const Case* case_expr = kind_cast<Case>(node))
 	{
-		n = arguments[i]->output_computation(out, n, env);
-		comps.push_back(n);
-		++n;
+		cond.test = case_expr->scrutinee;
+		return true_false(case_expr, cond.when_true, cond.when_false);
 	}
-	int nfunc = to_apply->output_computation(out, n, env);
-	out << "    comp_t *e" << n+1 << " = app(e" << nfunc << ", " << arguments.size();
-	for (auto comp : comps)
-		out << ", e" << comp;
-	out << ");" << endl;
-	return nfunc+1;
-}
-int Operator::output_computation(ostream& out, int n, const Environment& env)
-{
-	out << "    comp_t *e" << n << " = " << env.lookup(id)<<"; /* " << id <<" (" << c_id(id) << ") */" << endl;
-	return n;
+	const Apply* apply = kind_cast<Apply>(node);
+	if (!apply)
+		return false;
+	const Symbol* symbol = callee(apply, locals);
+	if (!symbol || !symbol->source || apply->arguments.size() != symbol->arity)
+		return false;
+	int test, yes, no;
+	if (!selector(symbol->source, test, yes, no))
+		return false;
+	cond = { apply->arguments[test], apply->arguments[yes], apply->arguments[no] };
+	return true;
 }
-int Ctor::output_computation(ostream& out, int n, const Environment& env)
+static Vars strict_vars(const Node* node, Vars& locals)
 {
-	vector<int> comps;
-	for (int i=0; i<arguments.size(); ++i)
+	Vars vars;
+	Cond cond;
+	if (const Var* var = kind_cast<Var>(node))
 	{
-		n = arguments[i]->output_computation(out, n, env);
-		comps.push_back(n);
-		++n;
+		if (locals.count(var->id))
+			vars.insert(var->id);
 	}
-	out << "    *e" << n+1 << " = ctor(" << id << ", " << arguments.size();
-	for (auto comp : comps)
-		out << ", e" << comp;
-	out << ");" << endl;
-	return n+1;
-}
-int CtorPat::output_computation(ostream& out, int n, const Environment& env)
-{
-	vector<int> comps;
-	for (int i=0; i<arguments.size(); ++i)
+	else if (as_cond(node, locals, cond))
 	{
-		//n = arguments[i]->output_computation(out, n, env);
-		out << "    *e" << n << " = " << env.lookup(arguments[i]) << "; // CTORPAT " << arguments[i] << endl;
-		comps.push_back(n);
-		++n;
+		// the test, and whatever both branches force
+		vars = strict_vars(cond.test, locals);
+		Vars when_true = strict_vars(cond.when_true, locals);
+		for (auto var : strict_vars(cond.when_false, locals))
+			if (when_true.count(var))
+				vars.insert(var);
 	}
-	out << "    *e" << n+1 << " = ctor(" << id << ", " << arguments.size();
-	for (auto comp : comps)
-		out << ", e" << comp;
-	out << ");" << endl;
-	return n+1;
-}
-int Ccall::output_computation(ostream& out, int n, const Environment& env)
-{
-	vector<int> comps;
-	for (int i=0; i<arguments.size(); ++i)
+	else if (const Apply* apply = kind_cast<Apply>(node))
 	{
-		n = arguments[i]->output_computation(out, n, env);
-		comps.push_back(n);
-		++n;
+		const Symbol* symbol = callee(apply, locals);
+		if (!symbol)
+			vars = strict_vars(apply->to_apply, locals);
+		else if (apply->arguments.size() >= symbol->arity)
+			for (int i=0; i<symbol->arity && i<16; ++i)
+				if (symbol->strict & 1u << i)
+				{
+					Vars arg = strict_vars(apply->arguments[i], locals);
+					vars.insert(arg.begin(), arg.end());
+				}
 	}
-	out << c_id << "(eval(e" << comps[0] << ")->val.value);" << endl;
-	return n-1;
-}
-int Case::output_computation(ostream& out, int n, const Environment& env)
-{
-	n = scrutinee->output_computation(out, n, env);
-	out << "   e"<<n<<" = eval(e" << n << "); // force scrutinee" << endl;
-	int scrutinee_reg = n;
-	int result_reg = n+1;
-	out << "    comp_t* e"<<result_reg<<";"<<endl;
-	bool ifonly=true;
-	for (auto pat_expr : patExprs)
+	else if (const Case* case_expr = kind_cast<Case>(node))
 	{
-		//if scrutinee_reg->tag == pat_expr.pat
-		Environment case_env = env;
-		out << "    ";
-		if (!ifonly)
-			out << "else ";
-		ifonly = false;
-		out <<"if (e" << scrutinee_reg << "->val.tag == ";
-		CtorPat* ctor_pat = dynamic_cast<CtorPat*>(pat_expr.pat);
-		int body_reg = scrutinee_reg + 2;
-		if (ctor_pat)
+		// the scrutinee, and whatever every alternative forces
+		vars = strict_vars(case_expr->scrutinee, locals);
+		Vars common;
+		bool first = true;
+		for (auto pat_expr : case_expr->patExprs)
 		{
-			int pat_bind_reg = scrutinee_reg+2;
-			for (auto ctor_arg : ctor_pat->arguments)
-				case_env.bind_reg(ctor_arg, pat_bind_reg++);
-			body_reg = pat_bind_reg;
-			out << c_id(ctor_pat->id);
-			out << ") {" << endl;
-			pat_bind_reg = scrutinee_reg+2;
-			int ctor_arg_index = 0;
-			for (auto ctor_arg : ctor_pat->arguments)
+			// a failed match stops the program, so it forces anything
+			if (kind_cast<Fail>(pat_expr.expr))
+				continue;
+			LocalScope scope(locals);
+			vector<Name> bound = pattern_vars(pat_expr.pat);
+			for (auto name : bound)
+				scope.add(name);
+			Vars alt = strict_vars(pat_expr.expr, locals);
+			for (auto name : bound)
+				alt.erase(name);
+			if (first)
+				common = alt;
+			else
 			{
-				out << "    comp_t* e" << pat_bind_reg << " = e" << scrutinee_reg
-										<< "->args[" << ctor_arg_index << "]; // " << ctor_arg << endl;
-				pat_bind_reg++;
-				ctor_arg_index++;
+				Vars both;
+				for (auto var : alt)
+					if (common.count(var))
+						both.insert(var);
+				common = both;
 			}
+			first = false;
 		}
-		else
+		vars.insert(common.begin(), common.end());
+	}
+	else if (const Let* let = kind_cast<Let>(node))
+	{
+		// the body, and whatever a let binding the body forces forces
+		LocalScope scope(locals);
+		for (auto binding : let->bindings)
+			scope.add(binding.name);
+		vars = strict_vars(let->body, locals);
+		for (auto i_binding = let->bindings.rbegin(); i_binding != let->bindings.rend(); ++i_binding)
+			if (vars.erase(i_binding->name) && !let->recursive)
+			{
+				Vars forced = strict_vars(i_binding->expr, locals);
+				vars.insert(forced.begin(), forced.end());
+			}
+		if (let->recursive)
+			for (auto binding : let->bindings)
+				vars.erase(binding.name);
+	}
+	else if (const Ccall* ccall = kind_cast<Ccall>(node))
+	{
+		for (auto arg : ccall->arguments)
 		{
-			out << *pat_expr.pat;
-			out << ") {" << endl;
+			Vars forced = strict_vars(arg, locals);
+			vars.insert(forced.begin(), forced.end());
 		}
-		//n = pat_expr.pat->output_computation(out, scrutinee_reg+1, env);
-		n = pat_expr.expr->output_computation(out, body_reg, case_env);
-		out << "    e"<<result_reg << " = e" << n << ';'<< endl;
-		out << "    }" << endl;
 	}
-	return result_reg;
+	return vars;
 }
-void Function::output_function_definition(ostream& out, const string& id) const
+unsigned Function::strict_arguments() const
 {
-	output_function_heading(out, id);
-	out << "{" << endl;
-	int n = body->output_computation(out, 0, arguments);
-	out << "    *result = e" << n << ";" << endl;
-	out << "}" << endl;
+	Vars locals(arguments.begin(), arguments.end());
+	Vars forced = strict_vars(body, locals);
+	unsigned strict = 0;
+	for (int i=0; i<arguments.size() && i<16; ++i)
+		if (forced.count(arguments[i]))
+			strict |= 1u << i;
+	return strict;
 }
-Var* parse_var(Parser& parser, istream& in)
+static unsigned all_arguments(int arity)
 {
-	if (parser.token.type == TT_VARID)
-	{
-		Var* var = new Var(parser.token.text);
-		parser.next(in);
-		return var;
-	}
-	return nullptr;
+	return arity >= 16 ? 0xffff : (1u << arity) - 1;
 }
-Var* parse_con(Parser& parser, istream& in)
+static void analyse_strictness()
 {
-	if (parser.token.type == TT_CONID)
+	for (auto& entry : symbols)
+		if (entry.second.source && !entry.second.imported)
+			entry.second.strict = all_arguments(entry.second.arity);
+	for (bool changed = true; changed; )
 	{
-		Var* var = new Var(parser.token.text);
-		parser.next(in);
-		return var;
+		changed = false;
+		for (auto& entry : symbols)
+		{
+			Symbol& symbol = entry.second;
+			if (!symbol.source || symbol.imported)
+				continue;
+			unsigned strict = symbol.source->strict_arguments();
+			if (strict != symbol.strict)
+			{
+				symbol.strict = strict;
+				changed = true;
+			}
+		}
 	}
-	return nullptr;
 }
-Node* parse_literal(Parser& parser, istream& in)
+/*
+ * Data results. A function whose every result is a number, a string or
+ * a saturated constructor cannot be applied to more arguments than it
+ * takes, any more than a constructor can, so Apply::known reports such a
+ * call. Other functions may return functions and are left alone.
+ * Solved like strictness, from "every function returns data", dropping
+ * functions until nothing changes.
+ */
+static bool data_result(const Node* node, Vars& locals)
 {
-	if (parser.token.type == TT_INTEGER)
+	if (kind_cast<Num>(node) || kind_cast<Str>(node) || kind_cast<Fail>(node))
+		return true;
+	if (const Var* var = kind_cast<Var>(node))
 	{
-		Num* num = new Num(parser.token.ival);
-		parser.next(in);
-		return num;
+		auto i_symbol = symbols.find(var->id);
+		if (locals.count(var->id) || i_symbol == symbols.end())
+			return false;
+		const Symbol& symbol = i_symbol->second;
+		return symbol.arity == 0 && (symbol.kind != Symbol::FUNCTION || symbol.data);
 	}
-	if (parser.token.type == TT_DOUBLE)
+	if (const Apply* apply = kind_cast<Apply>(node))
 	{
-		Num* num = new Num(parser.token.dval);
-		parser.next(in);
-		return num;
+		const Symbol* symbol = callee(apply, locals);
+		if (!symbol || apply->arguments.size() != symbol->arity)
+			return false;
+		return symbol->kind != Symbol::FUNCTION || symbol->data;
 	}
-	if (parser.token.type == TT_STRING)
+	if (const Case* case_expr = kind_cast<Case>(node))
 	{
-		Str* str = new Str(parser.token.text);
-		parser.next(in);
-		return str;
+		for (auto pat_expr : case_expr->patExprs)
+		{
+			LocalScope scope(locals);
+			for (auto name : pattern_vars(pat_expr.pat))
+				scope.add(name);
+			if (!data_result(pat_expr.expr, locals))
+				return false;
+		}
+		return true;
 	}
-	// This is where character and string literals go
-	return nullptr;
-}
-Node* parse_oper(Parser& parser, istream& in)
-{
-	if (parser.token.type == TT_OPER)
+	if (const Let* let = kind_cast<Let>(node))
 	{
-		Operator* oper = new Operator(parser.token.text);
-		parser.next(in);
-		return oper;
+		LocalScope scope(locals);
+		for (auto binding : let->bindings)
+			scope.add(binding.name);
+		return data_result(let->body, locals);
 	}
-	return nullptr;
+	return false;
 }
-Node* parse_apat(Parser& parser, istream& in)
+bool Function::data_result() const
 {
-	Node* apat = parse_var(parser,in);
-	if (!apat)
+	Vars locals(arguments.begin(), arguments.end());
+	return ::data_result(body, locals);
+}
+static void find_data_results()
+{
+	for (auto& entry : symbols)
+		entry.second.data = entry.second.source && !entry.second.imported;
+	for (bool changed = true; changed; )
 	{
-		Var* conid = parse_con(parser,in);
-		if (conid)
+		changed = false;
+		for (auto& entry : symbols)
 		{
-			//LOG(parser.token);
-			vector<Node*> arguments;
-			vector<string> names;
-			for (Node* argpat = parse_apat(parser, in);
-					argpat != nullptr;
-					argpat = parse_apat(parser, in))
-			{
-				arguments.push_back(argpat);
-				auto varpat = dynamic_cast<Var*>(argpat);
-				if (varpat)
-					names.push_back(varpat->id);
-				//LOG(parser.token);
-			}
-			//LOG(parser.token);
-			//if (arguments.size())
-			if (names.size() == arguments.size())
-			{
-
-				CtorPat* ctor = new CtorPat(conid->id);
-				ctor->arguments = names;
-				apat = ctor;
-			}
-			else
+			Symbol& symbol = entry.second;
+			if (symbol.data && !symbol.source->data_result())
 			{
-				Ctor* ctor = new Ctor(conid->id);
-				ctor->arguments = arguments;
-				apat = ctor;
+				symbol.data = false;
+				changed = true;
 			}
 		}
 	}
-	return apat;
 }
 /*
- * Let's go to the Haskell reference to be consistent
- * and avoid unnecessary deviation.
- *
- * topdecl = data simpletype [ '=' constrs][deriving]
- *         | decl
- * simpletype = tycon tyvar*
- * constrs = constr ('|' constr)*
- * constr = con atype*
- *          | btype conop btype
- *          | con '{' fielddecl* '}'
- * fielddecl = vars '::' type
- * tycon = conid
- * tyvar = varid
- * btype = btype? atype
- * atype = gtycon | tyvar
- * gtycon = qtycon
- * qtycon = qual? tycon
- * conop = consym | `conid`
- * decl = funlhs rhs
- * funlhs = var apat+
- *        | pat varop pat
- *        | '(' funlhs ')' apat+
- * rhs = '=' exp whereclause?
- *       | gdrhs whereclause?
- * whereclause = 'where' decls
- * exp = infixexp
- * infixexp = lexp qop infixexp
- *          | '-' infixexp
- *          | lexp
- * lexp = 'let' decls 'in' exp
- *        | 'if' exp ';'? 'then' exp ';'? else exp
- *        | 'case' exp 'of' '{' alts '}' # where the brackets could be from layout
- *        | fexp
- * fexp = fexp? aexp
- * aexp = qvar
- *        | gcon
- *        | literal
- *        | '(' exp ')'
- *        # This is where syntax sugar for tuples and lists goes too.
- * alts = alt ( ';' alt )*
- * alt = pat -> exp whereclause?
- * pat = lpat
- * lpat = apat
- *      | '-' (integer|float)
- *      | gcon apat+
- * apat = var
- *      | gcon
- *      | literal
- *      | '_'
- *      | '(' pat ')'
- *      | '(' pat+ ')'
- *      | '[' pat+ ']'
- * qvar = qvarid
- * qvarid = qual? varid
- * qual = modid '.' # That is, a qualifier is a string of conids with periods. Prelude.Data.
- * modid = qual* conid
- *
- * gcon = '(' ')'
- *        | '[' ']'
- *        | '(' ','+ ')'
- *        | qcon
- * qcon = qconid
- *        | '(' qconsym ')'
- * qconid = qual? conid
- * qconsym = qual? consym
- *
- * One form of expression that conforms to the above and is easier to parse is
- * exp = apply
- *      | var
- *      | literal
- *      | conapply
- *      | '(' exp ')'
- * apply = var | '(' exp ')' exp*
- * conapply = conid exp*
+ * Unboxed workers. A function that is strict in all its arguments and
+ * whose body only combines them with literals, arithmetic, comparisons,
+ * conditionals and calls of other such functions gets a worker over
+ * unum_t values in C variables, which allocates nothing. fun_<name>
+ * stays as a wrapper for lazy callers: it unboxes the arguments, calls
+  * work_<name> and boxes the result.
  */
-Node* parse_expr(Parser& parser, istream& in);
-Node* parse_case(Parser& parser, istream& in)
+static const Vars arithmetic = { "*", "-", "%", "/", "+", "+#" };
+static const Vars comparison = { ">", "<", ">=", "<=", "==" };
+static bool numeric(const Node* node, const Vars& args);
+static bool boolean(const Node* node, const Vars& args)
 {
-	//LOG("Hi! case statement");
-	parser.next(in);
-	//LOG(parser.token);
-	Node* scrutinee = parse_expr(parser,in);
-	if (parser.token.type != TT_OF)
-		throw Error(line_number, "case expr should have 'of'");
-	parser.next(in);
-	//LOG(parser.token);
-	if (parser.token.text != "{")
-		throw Error(line_number, "case expr of should have '{'");
-	parser.next(in);
-	//LOG(parser.token);
-
-	Case* case_node = new Case(scrutinee);
-	while (parser.token.text != "}")
-	{
-		Case::PatExpr pat_expr;
-		pat_expr.pat = parse_apat(parser,in);
-		//LOG(parser.token);
-		if (parser.token.type != TT_ARROW_TO)
-			throw Error(line_number, "case expr of { pat should have '->'");
-		parser.next(in);
-		//LOG(parser.token);
-		pat_expr.expr = parse_expr(parser, in);
-		//LOG(parser.token);
-		case_node->patExprs.push_back(pat_expr);
-		if (parser.token.text == "}")
-			break;
-		if (parser.token.type == TT_SEMI)
-			parser.next(in);
-		else
-			throw Error(line_number, "case expr of { pat -> expr should have ';'");
-		//LOG(parser.token);
-	}
-	if (parser.token.text != "}")
-		throw Error(line_number, "case expr of { pat->expr ... should end with '}'");
-	parser.next(in);
-	return case_node;
+	const Apply* apply = kind_cast<Apply>(node);
+	return apply && callee(apply, args) && comparison.count(head_id(apply))
+		&& apply->arguments.size() == 2
+		&& numeric(apply->arguments[0], args) && numeric(apply->arguments[1], args);
 }
-Node* parse_primary(Parser& parser, istream& in);
-Ccall* parse_ccall(Parser& parser, istream& in)
+static bool numeric(const Node* node, const Vars& args)
 {
-	if (parser.token.text == "ccall")
+	if (kind_cast<Num>(node))
+		return true;
+	if (const Var* var = kind_cast<Var>(node))
+		return args.count(var->id);
+	Cond cond;
+	if (as_cond(node, args, cond))
+		return boolean(cond.test, args) && numeric(cond.when_true, args) && numeric(cond.when_false, args);
+	const Apply* apply = kind_cast<Apply>(node);
+	if (!apply)
+		return false;
+	const Symbol* symbol = callee(apply, args);
+	if (!symbol || apply->arguments.size() != symbol->arity)
+		return false;
+	if (!arithmetic.count(head_id(apply)) && !symbol->worker)
+		return false;
+	for (auto arg : apply->arguments)
+		if (!numeric(arg, args))
+			return false;
+	return true;
+}
+// The arguments a primitive uses as numbers. Only these are known to be
+// numbers: id x = x is strict in x, but x may be anything.
+static void operands(const Node* node, Vars& vars)
+{
+	if (const Apply* apply = kind_cast<Apply>(node))
 	{
-		parser.next(in);
-		Var* id = parse_var(parser,in);
+		bool primitive = arithmetic.count(head_id(apply)) || comparison.count(head_id(apply));
+		for (auto arg : apply->arguments)
+		{
+			const Var* var = kind_cast<Var>(arg);
+			if (primitive && var)
+				vars.insert(var->id);
+			operands(arg, vars);
+		}
+		operands(apply->to_apply, vars);
+	}
+	else if (const Case* case_expr = kind_cast<Case>(node))
+	{
+		operands(case_expr->scrutinee, vars);
+		for (auto pat_expr : case_expr->patExprs)
+			operands(pat_expr.expr, vars);
+	}
+}
+// Start from every function that is strict in all its arguments and uses
+// each of them as a number, and drop those whose bodies are not numeric
+// until the rest only call each other.
+static void find_workers()
+{
+	for (auto& entry : symbols)
+	{
+		Symbol& symbol = entry.second;
+		if (symbol.imported)
+			continue;
+		symbol.worker = symbol.source && symbol.arity > 0 && symbol.arity <= 16
+			&& symbol.strict == all_arguments(symbol.arity);
+		if (!symbol.worker)
+			continue;
+		Vars used;
+		operands(symbol.source->body, used);
+		for (auto arg : symbol.source->arguments)
+			if (!used.count(arg))
+				symbol.worker = false;
+	}
+	for (bool changed = true; changed; )
+	{
+		changed = false;
+		for (auto& entry : symbols)
+		{
+			Symbol& symbol = entry.second;
+			const Function* function = symbol.source;
+			if (symbol.worker && !symbol.imported && !numeric(function->body, Vars(function->arguments.begin(), function->arguments.end())))
+			{
+				symbol.worker = false;
+				changed = true;
+			}
+		}
+	}
+}
+static void output_unboxed(ostream& out, const Node* node, const Vars& args);
+static void output_test(ostream& out, const Node* node, const Vars& args)
+{
+	const Apply* apply = kind_cast<Apply>(node);
+	out << "unum_" << c_id(head_id(apply)) << '(';
+	output_unboxed(out, apply->arguments[0], args);
+	out << ", ";
+	output_unboxed(out, apply->arguments[1], args);
+	out << ')';
+}
+static void output_unboxed(ostream& out, const Node* node, const Vars& args)
+{
+	if (const Num* num = kind_cast<Num>(node))
+	{
+		if (num->integer)
+			out << "unum_int(" << num->ivalue << ')';
+		else
+			out << "unum_real(" << setprecision(17) << num->value << ')';
+		return;
+	}
+	if (const Var* var = kind_cast<Var>(node))
+	{
+		out << "u_" << c_id(var->id);
+		return;
+	}
+	Cond cond;
+	if (as_cond(node, args, cond))
+	{
+		out << '(';
+		output_test(out, cond.test, args);
+		out << " ? ";
+		output_unboxed(out, cond.when_true, args);
+		out << " : ";
+		output_unboxed(out, cond.when_false, args);
+		out << ')';
+		return;
+	}
+	const Apply* apply = kind_cast<Apply>(node);
+	Name id = head_id(apply);
+	if (arithmetic.count(id))
+		out << "unum_" << c_id(id) << '(';
+	else
+		out << "work_" << id << '(';
+	for (int i=0; i<apply->arguments.size(); ++i)
+	{
+		if (i)
+			out << ", ";
+		output_unboxed(out, apply->arguments[i], args);
+	}
+	out << ')';
+}
+// A value in tail position is returned, a conditional becomes an if, and
+// a call of the worker itself reassigns the arguments and loops.
+static void output_tail(ostream& out, const Node* node, const Function& function, Name id, bool& loops)
+{
+	Vars args(function.arguments.begin(), function.arguments.end());
+	Cond cond;
+	if (as_cond(node, args, cond))
+	{
+		out << "    if (";
+		output_test(out, cond.test, args);
+		out << ") {" << endl;
+		output_tail(out, cond.when_true, function, id, loops);
+		out << "    } else {" << endl;
+		output_tail(out, cond.when_false, function, id, loops);
+		out << "    }" << endl;
+		return;
+	}
+	const Apply* apply = kind_cast<Apply>(node);
+	if (apply && head_id(apply) == id && !args.count(id))
+	{
+		for (int i=0; i<apply->arguments.size(); ++i)
+		{
+			out << "    unum_t next" << i << " = ";
+			output_unboxed(out, apply->arguments[i], args);
+			out << ';' << endl;
+		}
+		for (int i=0; i<apply->arguments.size(); ++i)
+			out << "    u_" << c_id(function.arguments[i]) << " = next" << i << ';' << endl;
+		out << "    goto tail;" << endl;
+		loops = true;
+		return;
+	}
+	out << "    return ";
+	output_unboxed(out, node, args);
+	out << ';' << endl;
+}
+void Function::output_worker_heading(ostream& out, Name id) const
+{
+	out << "unum_t work_" << id << " (";
+	for (int i=0; i<arguments.size(); ++i)
+		out << (i ? ", " : "") << "unum_t u_" << c_id(arguments[i]);
+	out << ")";
+}
+void Function::output_worker(ostream& out, Name id) const
+{
+	ostringstream body_out;
+	bool loops = false;
+	output_tail(body_out, body, *this, id, loops);
+	output_worker_heading(out, id);
+	out << endl << "{" << endl;
+	// deep in the C stack, leave the call to eval()
+	out << "    if (c_stack_deep())" << endl;
+	out << "        return unum_of(";
+	if (arguments.size() <= 3)
+		out << "app" << arguments.size() << "(&sc_" << id;
+	else
+		out << "app(&sc_" << id << ", " << arguments.size();
+	for (auto arg : arguments)
+		out << ", unum_box(u_" << c_id(arg) << ")";
+	out << "));" << endl;
+	if (loops)
+		out << "tail:" << endl;
+	out << body_out.str();
+	out << "}" << endl;
+}
+void Function::output_function_info(ostream& out, Name id) const
+{
+	out << "comp_t sc_" << id << " = { fun_" << id << ", " << arguments.size();
+	if (unsigned strict = symbols.at(id).strict)
+		out << ", .strict = " << strict;
+	out << "};" << endl;
+	output_profile_record(out, "", id, id);
+}
+void Function::output_function_extern(ostream& out, Name id) const
+{
+	out << "extern comp_t sc_" << id << ";" << endl;
+}
+void Function::output_function_prototype(ostream& out, Name id) const
+{
+	output_function_heading(out, id);
+	out << ';' << endl;
+	if (symbols.at(id).worker)
+	{
+		output_worker_heading(out, id);
+		out << ';' << endl;
+	}
+}
+/*
+ * Registers e0..eN are declared at the top of each supercombinator and
+ * pushed on the collector's root stack, so that a collection during a
+ * nested eval() can move what they point at. def_reg() starts an
+ * assignment to a register and records how many the function needs.
+ *
+ * A register whose value has been passed on, or that nothing on the
+ * path ahead reads, is dead, and output_dead() clears the dead ones
+ * before the code may wait on an evaluation, so that the collector does
+ * not keep alive what they pointed at. Otherwise a function that builds
+ * a list and hands it to a consumer would hold its head until it
+ * returns.
+ */
+static thread_local int register_count;
+static thread_local set<int> dead_regs;
+void use_reg(int n)
+{
+	if (n >= register_count)
+		register_count = n+1;
+	// registers are reused by the alternatives of a case and after it
+	dead_regs.erase(n);
+}
+static void release(int n)
+{
+	if (n >= 0)
+		dead_regs.insert(n);
+}
+static void output_dead(ostream& out)
+{
+	if (dead_regs.empty())
+		return;
+	out << "    ";
+	for (int reg : dead_regs)
+		out << 'e' << reg << " = ";
+	out << "0;" << endl;
+	dead_regs.clear();
+}
+static void free_names(const Node* node, Vars& bound, Uses& names);
+static Uses free_names(const Node* node);
+ostream& def_reg(ostream& out, int n)
+{
+	use_reg(n);
+	return out << "    e" << n << " = ";
+}
+void output_registers(ostream& out)
+{
+	out << "    comp_t";
+	for (int i=0; i<register_count; ++i)
+		out << (i ? ", " : " ") << "*e" << i << " = 0";
+	out << ";" << endl;
+	out << "    int roots = gc_nroots;" << endl;
+	out << "    GC_RESERVE(" << register_count << ");" << endl;
+	for (int i=0; i<register_count; ++i)
+		out << "    GC_PUSH(e" << i << ");" << endl;
+}
+/*
+ * Constant pool. Literals become statically initialised comp_t objects
+ * that are emitted once, ahead of the function definitions, so the
+ * generated code points at them instead of allocating on every call.
+ * Strings stay packed (ct_str) and are unpacked by the runtime as far
+ * as they are forced.
+ *
+ * Definitions are generated in parallel, so each one collects its
+ * literals in a pool of its own and refers to them by placeholder. The
+ * pools are then linked in definition order, which names every literal
+ * where it is first used, as if the definitions had been generated one
+ * after another.
+ */
+class ConstantPool
+{
+public:
+	string integer(long long value);
+	string real(double value);
+	string string_list(const string& text);
+	struct Literal {
+		string key;
+		string prefix;
+		string init; // the declaration after the name
+	};
+	vector<Literal> literals; // in order of first use
+private:
+	map<string, int> index;
+	string reference(const string& key, const char* prefix, const string& init);
+};
+static const char placeholder = '\x01'; // around a literal's index
+static thread_local ConstantPool constants;
+string ConstantPool::reference(const string& key, const char* prefix, const string& init)
+{
+	auto i_literal = index.find(key);
+	int k;
+	if (i_literal != index.end())
+		k = i_literal->second;
+	else
+	{
+		k = literals.size();
+		index[key] = k;
+		literals.push_back({ key, prefix, init });
+	}
+	return "&" + string(1, placeholder) + to_string(k) + placeholder;
+}
+string ConstantPool::integer(long long value)
+{
+	if (value >= 0 && value < 256)
+		return "&small_ints[" + to_string(value) + "]";
+	return reference("i" + to_string(value), "lit_",
+		" = { .val = {.ival = " + to_string(value) + "}, .type = ct_int };\n");
+}
+string ConstantPool::real(double value)
+{
+	ostringstream text;
+	text << setprecision(17) << value;
+	return reference("d" + text.str(), "lit_",
+		" = { .val = {.value = " + text.str() + "}, .type = ct_val };\n");
+}
+// The literals of the whole program, named in the order definitions are
+// linked.
+class LiteralTable
+{
+public:
+	string link(const vector<ConstantPool::Literal>& literals, const string& code);
+	void output(ostream& out) const { out << decls.str(); }
+private:
+	map<string, string> names;
+	ostringstream decls;
+	int count = 0;
+};
+static LiteralTable literal_table;
+string LiteralTable::link(const vector<ConstantPool::Literal>& literals, const string& code)
+{
+	vector<const string*> local;
+	for (auto& literal : literals)
+	{
+		string& name = names[literal.key];
+		if (name.empty())
+		{
+			name = literal.prefix + to_string(count++);
+			decls << "static comp_t " << name << literal.init;
+		}
+		local.push_back(&name);
+	}
+	if (literals.empty())
+		return code;
+	string linked;
+	linked.reserve(code.size());
+	for (size_t i=0; i<code.size(); )
+	{
+		size_t start = code.find(placeholder, i);
+		if (start == string::npos)
+		{
+			linked.append(code, i, string::npos);
+			break;
+		}
+		// a placeholder is digits between two marks; anything else
+		// (a stray mark in a comment) is copied as it is
+		size_t end = start+1;
+		while (end < code.size() && isdigit((unsigned char)code[end]))
+			++end;
+		linked.append(code, i, start-i);
+		size_t k = end < code.size() && code[end] == placeholder && end > start+1
+			? stoul(code.substr(start+1, end-start-1)) : local.size();
+		if (k < local.size())
+		{
+			linked += *local[k];
+			i = end+1;
+		}
+		else
+		{
+			linked += code[start];
+			i = start+1;
+		}
+	}
+	return linked;
+}
+// The lexer leaves escapes in string literals, so decode the ones C knows.
+static string unescape(const string& text)
+{
+	string bytes;
+	for (size_t i=0; i<text.size(); ++i)
+	{
+		if (text[i] != '\\' || i+1 == text.size())
+		{
+			bytes += text[i];
+			continue;
+		}
+		char ch = text[++i];
+		switch (ch)
+		{
+		case 'n': bytes += '\n'; break;
+		case 't': bytes += '\t'; break;
+		case 'r': bytes += '\r'; break;
+		case 'f': bytes += '\f'; break;
+		case 'v': bytes += '\v'; break;
+		case 'a': bytes += '\a'; break;
+		case 'b': bytes += '\b'; break;
+		case 'e': bytes += '\x1b'; break;
+		case 'x':
+		{
+			// one or two hex digits; the lexer saw there is at least one
+			int code = 0;
+			for (int k=0; k<2 && i+1<text.size() && isxdigit((unsigned char)text[i+1]); ++k)
+			{
+				char digit = text[++i];
+				code = code*16 + (isdigit((unsigned char)digit) ? digit-'0' : tolower(digit)-'a'+10);
+			}
+			bytes += char(code);
+			break;
+		}
+		default:
+			if (ch >= '0' && ch <= '7')
+			{
+				int code = 0, k = 0;
+				for (; k<3 && i<text.size() && text[i]>='0' && text[i]<='7'; ++k, ++i)
+					code = code*8 + text[i]-'0';
+				--i;
+				bytes += char(code);
+			}
+			else
+				bytes += ch;
+		}
+	}
+	return bytes;
+}
+string ConstantPool::string_list(const string& text)
+{
+	string bytes = unescape(text);
+	if (bytes.empty())
+		return "&sc_Nil";
+	ostringstream init;
+	init << " = { .val = {.str = \"";
+	for (unsigned char ch : bytes)
+		if (isprint(ch) && ch != '"' && ch != '\\' && ch != '?')
+			init << ch;
+		else
+			init << '\\' << oct << setw(3) << setfill('0') << (unsigned)ch << dec << setfill(' ');
+	init << "\"}, .arity = " << bytes.size() << ", .type = ct_str };\n";
+	return reference("s" + bytes, "str_", init.str());
+}
+int Var::output_computation(ostream& out, int n, Environment& env)
+{
+	check_defined(id, env);
+	def_reg(out, n) << env.lookup(id)<<"; /* " << id << "*/" << endl;
+	release(env.use(id));
+	return n;
+}
+int Str::output_computation(ostream& out, int n, Environment& env)
+{
+	def_reg(out, n) << constants.string_list(string(text)) << "; // \"" << text << "\"" << endl;
+	return n;
+}
+int Num::output_computation(ostream& out, int n, Environment& env)
+{
+	if (integer)
+		def_reg(out, n) << constants.integer(ivalue) << "; // " << ivalue << endl;
+	else
+		def_reg(out, n) << constants.real(value) << "; // " << value << endl;
+	return n;
+}
+/*
+ * Native arithmetic. A primitive application that may be computed right
+ * away becomes a C expression over unum_t locals, boxed once where the
+ * result is stored, instead of an application for eval() to reduce. In
+ * strict position any operand is allowed: the ones that are not
+ * arithmetic themselves are computed first and read with unum_of(). In a
+ * lazy position the leaves must be literals or arguments the function is
+ * strict in, which may be forced at any time, and the operations must
+ * not fail, so / and % are left to the runtime there.
+ */
+static thread_local unsigned strict_args; // of the function being generated
+static thread_local int unboxed_count;
+static bool native_op(const Node* node, Environment& env)
+{
+	const Apply* apply = kind_cast<Apply>(node);
+	if (!apply || apply->arguments.size() != 2)
+		return false;
+	Name id = head_id(apply);
+	return !id.empty() && !env.bound(id) && (arithmetic.count(id) || comparison.count(id));
+}
+static bool native_lazy(const Node* node, Environment& env)
+{
+	if (kind_cast<Num>(node))
+		return true;
+	if (const Var* var = kind_cast<Var>(node))
+	{
+		int index = env.argument(var->id);
+		return index >= 0 && index < 16 && (strict_args & 1u << index);
+	}
+	if (!native_op(node, env))
+		return false;
+	const Apply* apply = kind_cast<Apply>(node);
+	Name id = head_id(apply);
+	if (id == "/" || id == "%")
+		return false;
+	return native_lazy(apply->arguments[0], env) && native_lazy(apply->arguments[1], env);
+}
+// Emit the statements that unbox the leaves of an arithmetic tree in
+// order, since unum_of() may collect, and return the expression.
+static string output_native(ostream& out, int& n, const Node* node, Environment& env)
+{
+	ostringstream expr;
+	if (const Num* num = kind_cast<Num>(node))
+	{
+		if (num->integer)
+			expr << "unum_int(" << num->ivalue << ')';
+		else
+			expr << "unum_real(" << setprecision(17) << num->value << ')';
+		return expr.str();
+	}
+	const Apply* apply = kind_cast<Apply>(node);
+	if (native_op(node, env) && arithmetic.count(head_id(apply)))
+	{
+		string left = output_native(out, n, apply->arguments[0], env);
+		string right = output_native(out, n, apply->arguments[1], env);
+		expr << "unum_" << c_id(head_id(apply)) << '(' << left << ", " << right << ')';
+		return expr.str();
+	}
+	string value;
+	int reg = -1;
+	const Var* var = kind_cast<Var>(node);
+	if (var)
+	{
+		check_defined(var->id, env);
+		value = env.lookup(var->id);
+	}
+	else
+	{
+		reg = const_cast<Node*>(node)->output_strict(out, n, env);
+		n = reg+1;
+		value = "e" + to_string(reg);
+	}
+	output_dead(out);
+	int u = unboxed_count++;
+	out << "    unum_t u" << u << " = unum_of(" << value << ");" << endl;
+	release(var ? env.use(var->id) : reg);
+	return "u" + to_string(u);
+}
+static int output_native_box(ostream& out, int n, const Apply* apply, Environment& env)
+{
+	Name id = head_id(apply);
+	if (comparison.count(id))
+	{
+		string left = output_native(out, n, apply->arguments[0], env);
+		string right = output_native(out, n, apply->arguments[1], env);
+		def_reg(out, n) << "unum_" << c_id(id) << '(' << left << ", " << right
+			<< ") ? &sc_True : &sc_False; // " << id << endl;
+	}
+	else
+	{
+		string expr = output_native(out, n, apply, env);
+		def_reg(out, n) << "unum_box(" << expr << "); // " << id << endl;
+	}
+	return n;
+}
+const Symbol* Apply::known(Environment& env) const
+{
+	Name id = head_id(this);
+	if (id.empty() || env.bound(id))
+		return nullptr;
+	auto i_symbol = symbols.find(id);
+	if (i_symbol == symbols.end())
+		return nullptr;
+	// a function may return a function, but nothing can be applied
+	// to a constructed value or a number
+	const Symbol& symbol = i_symbol->second;
+	if ((symbol.kind != Symbol::FUNCTION || symbol.data) && arguments.size() > symbol.arity)
+		throw Error(definition_line, id + " takes " + to_string(symbol.arity)
+			+ " arguments but is given " + to_string(arguments.size()));
+	return &symbol;
+}
+// A saturated call of a known supercombinator whose value is wanted now
+// goes straight to its C function with an exactly sized, rooted argument
+// vector. Arguments the callee forces are themselves in strict position.
+// Constants (arity 0) are shared, so they are never called this way.
+int Apply::output_strict(ostream& out, int n, Environment& env)
+{
+	if (native_op(this, env))
+		return output_native_box(out, n, this, env);
+	const Symbol* symbol = known(env);
+	if (!symbol || symbol->arity == 0 || arguments.size() != symbol->arity)
+		return output_computation(out, n, env);
+	vector<int> comps;
+	for (int i=0; i<arguments.size(); ++i)
+	{
+		if (i < 16 && (symbol->strict & 1u << i))
+			n = arguments[i]->output_strict(out, n, env);
+		else
+			n = arguments[i]->output_computation(out, n, env);
+		comps.push_back(n);
+		++n;
+	}
+	use_reg(n);
+	out << "    {" << endl;
+	out << "    comp_t* argv[" << comps.size() << "] = {";
+	for (int i=0; i<comps.size(); ++i)
+		out << (i ? ", " : " ") << "e" << comps[i];
+	out << " };" << endl;
+	out << "    int call_roots = gc_nroots;" << endl;
+	out << "    GC_RESERVE(" << comps.size() << ");" << endl;
+	for (int i=0; i<comps.size(); ++i)
+		out << "    GC_PUSH(argv[" << i << "]);" << endl;
+	for (auto comp : comps)
+		release(comp);
+	output_dead(out);
+	out << "    call_known(" << symbol->function << ", &e" << n << ", argv);" << endl;
+	out << "    gc_nroots = call_roots;" << endl;
+	out << "    }" << endl;
+	return n;
+}
+int Apply::output_computation(ostream& out, int n, Environment& env)
+{
+	known(env);
+	if (native_lazy(this, env))
+		return output_native_box(out, n, this, env);
+	vector<int> comps;
+	for (int i=0; i<arguments.size(); ++i)
+	{
+		n = arguments[i]->output_computation(out, n, env);
+		comps.push_back(n);
+		++n;
+	}
+	int nfunc = to_apply->output_computation(out, n, env);
+	// app1..app3 build the node and its arguments in one allocation
+	// without going through varargs
+	if (arguments.size() <= 3)
+		def_reg(out, n+1) << "app" << arguments.size() << "(e" << nfunc;
+	else
+		def_reg(out, n+1) << "app(e" << nfunc << ", " << arguments.size();
+	for (auto comp : comps)
+	{
+		out << ", e" << comp;
+		release(comp);
+	}
+	out << ");" << endl;
+	release(nfunc);
+	return nfunc+1;
+}
+int Operator::output_computation(ostream& out, int n, Environment& env)
+{
+	check_defined(id, env);
+	def_reg(out, n) << env.lookup(id)<<"; /* " << id <<" (" << c_id(id) << ") */" << endl;
+	release(env.use(id));
+	return n;
+}
+int Ctor::output_computation(ostream& out, int n, Environment& env)
+{
+	vector<int> comps;
+	for (int i=0; i<arguments.size(); ++i)
+	{
+		n = arguments[i]->output_computation(out, n, env);
+		comps.push_back(n);
+		++n;
+	}
+	out << "    *e" << n+1 << " = ctor(" << id << ", " << arguments.size();
+	for (auto comp : comps)
+		out << ", e" << comp;
+	out << ");" << endl;
+	return n+1;
+}
+int CtorPat::output_computation(ostream& out, int n, Environment& env)
+{
+	vector<int> comps;
+	for (int i=0; i<arguments.size(); ++i)
+	{
+		//n = arguments[i]->output_computation(out, n, env);
+		out << "    *e" << n << " = " << env.lookup(arguments[i]) << "; // CTORPAT " << arguments[i] << endl;
+		comps.push_back(n);
+		++n;
+	}
+	out << "    *e" << n+1 << " = ctor(" << id << ", " << arguments.size();
+	for (auto comp : comps)
+		out << ", e" << comp;
+	out << ");" << endl;
+	return n+1;
+}
+int Ccall::output_computation(ostream& out, int n, Environment& env)
+{
+	vector<int> comps;
+	for (int i=0; i<arguments.size(); ++i)
+	{
+		// the runtime forces what it writes
+		n = arguments[i]->output_strict(out, n, env);
+		comps.push_back(n);
+		++n;
+	}
+	const CcallFunction& function = ccall_functions.at(c_id);
+	output_dead(out);
+	if (function.integer)
+		out << "    " << function.runtime << "(ivalue(e" << comps[0] << "));" << endl;
+	else
+		out << "    " << function.runtime << "(e" << comps[0] << ");" << endl;
+	return n-1;
+}
+// the reads of a local in an alternative, unless its pattern hides it
+static int local_reads(const Case::PatExpr& pat_expr, const Uses& reads, Name name)
+{
+	vector<Name> vars = pattern_vars(pat_expr.pat);
+	if (find(vars.begin(), vars.end(), name) != vars.end())
+		return 0;
+	auto i_reads = reads.find(name);
+	return i_reads == reads.end() ? 0 : i_reads->second;
+}
+// A compiled case switches on the constructor tag, or tests the number
+// against each literal in turn. A variable pattern comes last and is the
+// default. The scrutinee's register is dead once the alternative has
+// taken the fields it reads, and each alternative starts with the locals
+// that neither it nor the code after the case reads marked dead.
+int Case::output_computation(ostream& out, int n, Environment& env)
+{
+	n = scrutinee->output_strict(out, n, env);
+	output_dead(out);
+	out << "   e"<<n<<" = eval(e" << n << "); // force scrutinee" << endl;
+	int scrutinee_reg = n;
+	int result_reg = n+1;
+	use_reg(result_reg);
+	// what each alternative reads, and which reads of the locals are
+	// left for after the case
+	vector<pair<Name, int>> pending = env.pending();
+	vector<Uses> alt_reads;
+	Uses after(pending.begin(), pending.end());
+	for (auto pat_expr : patExprs)
+	{
+		alt_reads.push_back(free_names(pat_expr.expr));
+		for (auto [name, count] : pending)
+			after[name] -= local_reads(pat_expr, alt_reads.back(), name);
+	}
+	set<int> dead_before = dead_regs, dead_after;
+	bool tags = false;
+	for (auto pat_expr : patExprs)
+		tags = tags || kind_cast<CtorPat>(pat_expr.pat);
+	if (tags)
+		out << "    switch (e" << scrutinee_reg << "->val.tag) {" << endl;
+	bool first = true;
+	for (int k=0; k<patExprs.size(); ++k)
+	{
+		auto pat_expr = patExprs[k];
+		Uses& reads = alt_reads[k];
+		dead_regs = dead_before;
+		for (auto [name, count] : pending)
+			release(env.expect(name, local_reads(pat_expr, reads, name) + after[name]));
+		Environment::Scope scope(env);
+		int body_reg = scrutinee_reg + 2;
+		if (CtorPat* ctor_pat = kind_cast<CtorPat>(pat_expr.pat))
+		{
+			out << "    case " << c_id(ctor_pat->id) << ": {" << endl;
+			int ctor_arg_index = 0;
+			for (auto ctor_arg : ctor_pat->arguments)
+			{
+				// a field that is not read is not fetched
+				if (reads[ctor_arg])
+				{
+					def_reg(out, body_reg) << "e" << scrutinee_reg
+											<< "->args[" << ctor_arg_index << "]; // " << ctor_arg << endl;
+					env.bind_reg(ctor_arg, body_reg, reads[ctor_arg]);
+				}
+				body_reg++;
+				ctor_arg_index++;
+			}
+			release(scrutinee_reg);
+		}
+		else if (Num* num = kind_cast<Num>(pat_expr.pat))
+		{
+			out << "    " << (first ? "" : "else ") << "if (";
+			if (num->integer)
+				out << "num_is(e" << scrutinee_reg << ", " << num->ivalue << "LL)";
+			else
+			{
+				ostringstream literal;
+				literal << setprecision(17) << num->value;
+				out << "dval(e" << scrutinee_reg << ") == " << literal.str();
+			}
+			out << ") {" << endl;
+			release(scrutinee_reg);
+		}
+		else
+		{
+			out << "    " << (tags ? "default: " : first ? "" : "else ") << "{" << endl;
+			Var* var = kind_cast<Var>(pat_expr.pat);
+			if (var && var->id != "_" && reads[var->id])
+				env.bind_reg(var->id, scrutinee_reg, reads[var->id]);
+			else
+				release(scrutinee_reg);
+		}
+		first = false;
+		n = pat_expr.expr->output_computation(out, body_reg, env);
+		out << "    e"<<result_reg << " = e" << n << ';'<< endl;
+		release(n);
+		use_reg(result_reg);
+		if (tags)
+			out << "    break;" << endl;
+		out << "    }" << endl;
+		dead_after.insert(dead_regs.begin(), dead_regs.end());
+	}
+	if (tags)
+		out << "    }" << endl;
+	dead_regs = dead_after;
+	for (auto [name, count] : pending)
+		env.expect(name, after[name]);
+	return result_reg;
+}
+int Fail::output_computation(ostream& out, int n, Environment& env)
+{
+	def_reg(out, n) << "match_fail();" << endl;
+	return n;
+}
+// Each binding keeps the register its value was built in, until the last
+// read of it. A letrec first makes a hole for every binding, so they can
+// refer to each other; filling the hole reads it once more.
+int Let::output_let(ostream& out, int n, Environment& env, bool strict)
+{
+	Environment::Scope scope(env);
+	// the reads of each binding, in the body and the bindings that see it
+	vector<int> reads(bindings.size());
+	vector<Uses> binding_reads;
+	for (auto binding : bindings)
+		binding_reads.push_back(free_names(binding.expr));
+	Uses body_reads = free_names(body);
+	for (int i=0; i<bindings.size(); ++i)
+	{
+		reads[i] = body_reads[bindings[i].name] + recursive;
+		for (int j = recursive ? 0 : i+1; j<bindings.size(); ++j)
+			reads[i] += binding_reads[j][bindings[i].name];
+	}
+	vector<int> holes;
+	if (recursive)
+		for (int i=0; i<bindings.size(); ++i)
+		{
+			def_reg(out, n) << "letrec_hole(); // " << bindings[i].name << endl;
+			env.bind_reg(bindings[i].name, n, reads[i]);
+			holes.push_back(n++);
+		}
+	// applying a node copies it, so a letrec binding that is applied in
+	// another is built before that one
+	vector<int> order;
+	vector<bool> built(bindings.size(), !recursive);
+	for (int i=0; i<bindings.size(); ++i)
+		if (!recursive)
+			order.push_back(i);
+	while (order.size() < bindings.size())
+	{
+		int before = order.size();
+		for (int i=0; i<bindings.size(); ++i)
+		{
+			const Apply* apply = kind_cast<Apply>(bindings[i].expr);
+			Name head = apply ? head_id(apply) : Name();
+			bool ready = !built[i];
+			for (int j=0; j<bindings.size(); ++j)
+				ready = ready && (built[j] || bindings[j].name != head);
+			if (ready)
+			{
+				order.push_back(i);
+				built[i] = true;
+			}
+		}
+		if (order.size() == before)
+			throw Error(definition_line, "letrec bindings apply each other");
+	}
+	for (int i : order)
+	{
+		int value = bindings[i].expr->output_computation(out, n, env);
+		if (recursive)
+		{
+			out << "    letrec_fill(e" << holes[i] << ", e" << value << ");" << endl;
+			release(value);
+			release(env.use(bindings[i].name));
+		}
+		else
+		{
+			env.bind_reg(bindings[i].name, value, reads[i]);
+			if (!reads[i])
+				release(value);
+		}
+		n = value + 1;
+	}
+	return strict ? body->output_strict(out, n, env)
+		: body->output_computation(out, n, env);
+}
+void Function::output_function_definition(ostream& out, Name id) const
+{
+	bool worker = symbols.at(id).worker;
+	if (worker)
+		output_worker(out, id);
+	output_function_heading(out, id);
+	out << "{" << endl;
+	// unboxed unless the C stack is already deep
+	if (worker)
+	{
+		out << "    if (!c_stack_deep()) {" << endl;
+		if (profile)
+			out << "    PROF_ENTER(prof_" << id << ");" << endl;
+		for (int i=0; i<arguments.size(); ++i)
+			out << "    unum_t u_" << c_id(arguments[i]) << " = unum_of(args[" << i << "]);" << endl;
+		out << "    *result = unum_box(work_" << id << "(";
+		for (int i=0; i<arguments.size(); ++i)
+			out << (i ? ", " : "") << "u_" << c_id(arguments[i]);
+		out << "));" << endl;
+		if (profile)
+			out << "    PROF_LEAVE();" << endl;
+		out << "    return;" << endl;
+		out << "    }" << endl;
+	}
+	ostringstream body_out;
+	register_count = 0;
+	dead_regs.clear();
+	unboxed_count = 0;
+	strict_args = symbols.at(id).strict;
+	Environment env(arguments.to_vector());
+	int n = body->output_computation(body_out, 0, env);
+	output_registers(out);
+	if (profile)
+		out << "    PROF_ENTER(prof_" << id << ");" << endl;
+	out << body_out.str();
+	if (profile)
+		out << "    PROF_LEAVE();" << endl;
+	out << "    gc_nroots = roots;" << endl;
+	out << "    *result = e" << n << ";" << endl;
+	out << "}" << endl;
+}
+Var* parse_var(Parser& parser)
+{
+	if (parser.token.type == TT_VARID)
+	{
+		Var* var = new Var(Name(parser.token.text));
+		parser.next();
+		return var;
+	}
+	return nullptr;
+}
+Var* parse_con(Parser& parser)
+{
+	if (parser.token.type == TT_CONID)
+	{
+		Var* var = new Var(Name(parser.token.text));
+		parser.next();
+		return var;
+	}
+	return nullptr;
+}
+Node* parse_literal(Parser& parser)
+{
+	if (parser.token.type == TT_INTEGER)
+	{
+		Num* num = new Num(parser.token.ival);
+		parser.next();
+		return num;
+	}
+	if (parser.token.type == TT_DOUBLE)
+	{
+		Num* num = new Num(parser.token.dval);
+		parser.next();
+		return num;
+	}
+	if (parser.token.type == TT_STRING)
+	{
+		Str* str = new Str(string(parser.token.text));
+		parser.next();
+		return str;
+	}
+	// This is where character and string literals go
+	return nullptr;
+}
+Node* parse_oper(Parser& parser)
+{
+	if (parser.token.type == TT_OPER)
+	{
+		Operator* oper = new Operator(Name(parser.token.text));
+		parser.next();
+		return oper;
+	}
+	return nullptr;
+}
+Node* parse_pat(Parser& parser);
+// A variable (or _), a number, a constructor on its own or a
+// parenthesised pattern.
+Node* parse_apat(Parser& parser)
+{
+	Node* apat = parse_var(parser);
+	if (!apat && (parser.token.type == TT_INTEGER || parser.token.type == TT_DOUBLE))
+		apat = parse_literal(parser);
+	if (!apat)
+	{
+		Var* conid = parse_con(parser);
+		if (conid)
+			apat = new CtorPat(conid->id);
+	}
+	if (!apat && parser.token.type == TT_LPAREN)
+	{
+		parser.next();
+		apat = parse_pat(parser);
+		if (!apat || parser.token.type != TT_RPAREN)
+			throw Error(line_number,"pattern '(' not matched");
+		parser.next();
+	}
+	return apat;
+}
+// A constructor applied to patterns, or an apat. The arguments of a
+// constructor whose arguments are all variables are kept as names.
+Node* parse_pat(Parser& parser)
+{
+	Var* conid = parse_con(parser);
+	if (!conid)
+		return parse_apat(parser);
+	//LOG(parser.token);
+	vector<Node*> arguments;
+	vector<Name> names;
+	for (Node* argpat = parse_apat(parser);
+			argpat != nullptr;
+			argpat = parse_apat(parser))
+	{
+		arguments.push_back(argpat);
+		auto varpat = kind_cast<Var>(argpat);
+		if (varpat)
+			names.push_back(varpat->id);
+		//LOG(parser.token);
+	}
+	if (names.size() == arguments.size())
+	{
+		CtorPat* ctor = new CtorPat(conid->id);
+		ctor->arguments = names;
+		return ctor;
+	}
+	Ctor* ctor = new Ctor(conid->id);
+	ctor->arguments = arguments;
+	return ctor;
+}
+/*
+ * Let's go to the Haskell reference to be consistent
+ * and avoid unnecessary deviation.
+ *
+ * topdecl = data simpletype [ '=' constrs][deriving]
+ *         | decl
+ * simpletype = tycon tyvar*
+ * constrs = constr ('|' constr)*
+ * constr = con atype*
+ *          | btype conop btype
+ *          | con '{' fielddecl* '}'
+ * fielddecl = vars '::' type
+ * tycon = conid
+ * tyvar = varid
+ * btype = btype? atype
+ * atype = gtycon | tyvar
+ * gtycon = qtycon
+ * qtycon = qual? tycon
+ * conop = consym | `conid`
+ * decl = funlhs rhs
+ * funlhs = var apat+
+ *        | pat varop pat
+ *        | '(' funlhs ')' apat+
+ * rhs = '=' exp whereclause?
+ *       | gdrhs whereclause?
+ * whereclause = 'where' decls
+ * exp = infixexp
+ * infixexp = lexp qop infixexp
+ *          | '-' infixexp
+ *          | lexp
+ * lexp = 'let' decls 'in' exp
+ *        | 'if' exp ';'? 'then' exp ';'? else exp
+ *        | 'case' exp 'of' '{' alts '}' # where the brackets could be from layout
+ *        | fexp
+ * fexp = fexp? aexp
+ * aexp = qvar
+ *        | gcon
+ *        | literal
+ *        | '(' exp ')'
+ *        # This is where syntax sugar for tuples and lists goes too.
+ * alts = alt ( ';' alt )*
+ * alt = pat -> exp whereclause?
+ * pat = lpat
+ * lpat = apat
+ *      | '-' (integer|float)
+ *      | gcon apat+
+ * apat = var
+ *      | gcon
+ *      | literal
+ *      | '_'
+ *      | '(' pat ')'
+ *      | '(' pat+ ')'
+ *      | '[' pat+ ']'
+ * qvar = qvarid
+ * qvarid = qual? varid
+ * qual = modid '.' # That is, a qualifier is a string of conids with periods. Prelude.Data.
+ * modid = qual* conid
+ *
+ * gcon = '(' ')'
+ *        | '[' ']'
+ *        | '(' ','+ ')'
+ *        | qcon
+ * qcon = qconid
+ *        | '(' qconsym ')'
+ * qconid = qual? conid
+ * qconsym = qual? consym
+ *
+ * One form of expression that conforms to the above and is easier to parse is
+ * exp = apply
+ *      | var
+ *      | literal
+ *      | conapply
+ *      | '(' exp ')'
+ * apply = var | '(' exp ')' exp*
+ * conapply = conid exp*
+ */
+Node* parse_expr(Parser& parser);
+Node* parse_case(Parser& parser)
+{
+	//LOG("Hi! case statement");
+	parser.next();
+	//LOG(parser.token);
+	Node* scrutinee = parse_expr(parser);
+	if (parser.token.type != TT_OF)
+		throw Error(line_number, "case expr should have 'of'");
+	parser.next();
+	//LOG(parser.token);
+	if (parser.token.text != "{")
+		throw Error(line_number, "case expr of should have '{'");
+	parser.next();
+	//LOG(parser.token);
+
+	Case* case_node = new Case(scrutinee);
+	while (parser.token.text != "}")
+	{
+		Case::PatExpr pat_expr;
+		pat_expr.pat = parse_pat(parser);
+		if (!pat_expr.pat)
+			throw Error(line_number, "case expr of { should have a pattern");
+		//LOG(parser.token);
+		if (parser.token.type != TT_ARROW_TO)
+			throw Error(line_number, "case expr of { pat should have '->'");
+		parser.next();
+		//LOG(parser.token);
+		pat_expr.expr = parse_expr(parser);
+		//LOG(parser.token);
+		case_node->patExprs.push_back(pat_expr);
+		if (parser.token.text == "}")
+			break;
+		if (parser.token.type == TT_SEMI)
+			parser.next();
+		else
+			throw Error(line_number, "case expr of { pat -> expr should have ';'");
+		//LOG(parser.token);
+	}
+	if (parser.token.text != "}")
+		throw Error(line_number, "case expr of { pat->expr ... should end with '}'");
+	parser.next();
+	return case_node;
+}
+Node* parse_let(Parser& parser)
+{
+	Let* let = new Let(parser.token.type == TT_LETREC);
+	parser.next();
+	// the bindings and the body may start on a new line, after an
+	// inferred ';'
+	while (parser.token.type == TT_SEMI)
+		parser.next();
+	Vars names;
+	while (parser.token.type != TT_IN)
+	{
+		Var* name = parse_var(parser);
+		if (!name)
+			throw Error(line_number, "let should bind a variable");
+		if (!names.insert(name->id).second)
+			throw Error(line_number, "let binds " + name->id + " twice");
+		if (parser.token.type != TT_EQUALS)
+			throw Error(line_number, "let binding should have '='");
+		parser.next();
+		let->bindings.push_back({ name->id, parse_expr(parser) });
+		while (parser.token.type == TT_SEMI)
+			parser.next();
+		if (parser.token.type == TT_EOF)
+			throw Error(line_number, "let should have 'in'");
+	}
+	if (let->bindings.empty())
+		throw Error(line_number, "let should have a binding");
+	parser.next();
+	while (parser.token.type == TT_SEMI)
+		parser.next();
+	let->body = parse_expr(parser);
+	return let;
+}
+Node* parse_primary(Parser& parser);
+Ccall* parse_ccall(Parser& parser)
+{
+	if (parser.token.text == "ccall")
+	{
+		parser.next();
+		Var* id = parse_var(parser);
 		if (!id)
-			id = parse_con(parser,in);
+			id = parse_con(parser);
 		if (!id)
 			throw Error(line_number, "ccall requires an c function ID");
-		if (id->id=="putchar")
+		if (ccall_functions.count(id->id))
+		{
+			//LOG("");
+			Node* arg = parse_literal(parser);
+			if (!arg)
+				arg = parse_primary(parser);
+			Ccall* call = new Ccall();
+			call->c_id = id->id;
+			call->arguments.push_back(arg);
+			//LOG("");
+			return call;
+		}
+		else
+			throw Error(line_number, "ccall only works with a few c functions");
+	}
+	return nullptr;
+}
+Node* parse_primary(Parser& parser)
+{
+	Node* primary = nullptr;
+	//LOG(parser.token);
+	if (parser.token.type == TT_LPAREN)
+	{
+		parser.next();
+		primary = parse_expr(parser);
+		if (parser.token.type != TT_RPAREN)
+			throw Error(line_number,"left '(' not matched");
+		parser.next();
+	}
+	else if (parser.token.type == TT_CASE)
+	{
+		primary = parse_case(parser);
+	}
+	else if (parser.token.type == TT_LET || parser.token.type == TT_LETREC)
+	{
+		primary = parse_let(parser);
+	}
+	if (!primary)
+		primary = parse_ccall(parser);
+	if (!primary)
+		primary = parse_var(parser);
+	if (!primary) // an application could be an id but isn't always
+		primary = parse_con(parser);
+	if (!primary)
+		primary = parse_oper(parser);
+	if (!primary)
+		throw Error(line_number,string("[937] Expected variable, constructor or operator ")+TokenTypeStr[parser.token.type]);
+	return primary;
+}
+Node* parse_expr(Parser& parser)
+{
+	//LOG(parser.token);
+	Node* literal = parse_literal(parser);
+	if (literal)
+		return literal; // A literal cannot be applied as a function
+
+	//LOG(parser.token);
+	Node* apply = parse_primary(parser);
+	vector<Node*> arguments;
+	while (parser.token.type != TT_SEMI && parser.token.type != TT_RPAREN && parser.token.type != TT_OF && parser.token.type != TT_IN && parser.token.text != "}" && parser.token.type != TT_EOF)
+	{
+		Node* argument = parse_literal(parser);
+		if (!argument) { 		//LOG(parser.token);
+			argument = parse_primary(parser); }
+		//LOG("An argument " << *argument);
+		if (argument)
+			arguments.push_back(argument);
+	}
+	if (arguments.size()==0)
+		return apply;
+	Apply* application = new Apply();
+	application->to_apply = apply;
+	application->arguments = arguments;
+	return application;
+}
+/*
+ *
+ */
+Definition* parse_data(Parser& parser)
+{
+	parser.next();
+	Var* type_name = parse_con(parser);
+	if (type_name == nullptr)
+		throw Error(line_number, "expecting conid");
+	Definition* definition = new Definition();
+	definition->id = type_name->id;
+	definition->line = line_number;
+	Type* type = new Type();
+	while (parser.token.text != "=")
+	{
+		Var* arg = parse_var(parser);
+		type->arguments.push_back(arg->id);
+	}
+	parser.next();
+	while (parser.token.type != TT_SEMI)
+	{
+		Var* conid = parse_con(parser);
+		type->constructors.emplace_back();
+		Constructor* ctor = &type->constructors.back();
+		ctor->constructor = conid->id;
+		while (parser.token.type != TT_SEMI && parser.token.type != TT_PIPE)
+		{
+			Var* apat = parse_var(parser);
+			if (apat == nullptr)
+				throw Error(line_number, "expecting apat (1192)");
+			ctor->arguments.push_back(apat->id);
+		}
+		if (parser.token.type == TT_PIPE)
+		{
+			parser.next();
+		}
+		else
+		{
+			break;
+		}
+	}
+	//LOG(parser.token);
+	parser.next();
+	//LOG(parser.token);
+	//LOG("Type " << *type);
+	definition->defineable = type;
+	//LOG("Defined: " << definition->id);
+	return definition;
+	//throw Error(line_number, "data keyword not implemented");
+}
+Definition* parse_function(Parser& parser)
+{
+	//LOG(parser.token);
+	const char* start = parser.token.text.data();
+	Var* name = parse_var(parser);
+	if (name == nullptr)
+		throw Error(line_number,"expecting varid (1279)");
+	Definition* definition = new Definition();
+	definition->id = name->id;
+	definition->line = line_number;
+	Function* function = new Function();
+	//LOG("after name " << parser.token.text);
+	while (parser.token.text != "=")
+	{
+		//LOG(parser.token);
+		Var* arg = parse_var(parser);//parse_apat(parser);
+		if (arg == nullptr)
+			throw Error(line_number,"expecting varid (1227)");
+		function->arguments.push_back(arg->id);
+	}
+	//LOG(parser.token);
+	parser.next();
+	//LOG(parser.token);
+	Node* expr = parse_expr(parser);
+	if (parser.token.type != TT_SEMI)
+		throw Error(line_number,"semicolon expected");
+	definition->source = string_view(start, parser.token.text.data() + parser.token.text.size() - start);
+	parser.next();
+	function->body = expr;
+	definition->defineable = function;
+	//LOG("Defined: " << definition->id);
+	return definition;
+}
+Definition* parse_definition(Parser& parser)
+{
+	if (parser.token.type == TT_DATA)
+		return parse_data(parser);
+	else
+		return parse_function(parser);
+}
+typedef list<Definition*> Definitions;
+Definitions parse_definitions(Parser& parser)
+{
+	Definitions definitions;
+	while (parser.token.type != TT_EOF)
+	{
+		Definition* definition = parse_definition(parser);
+		definitions.push_back(definition);
+	}
+
+	return definitions;
+}
+/*
+ * Inlining. A call of a small non-recursive function is replaced by the
+ * function's body with the arguments substituted, which saves building
+ * the application, the eval() round trip and the copy of the result. A
+ * call is inlined when it is saturated, the body has at most inline_limit
+ * nodes (--inline=N, 0 turns inlining off), no argument that is more than
+ * a name or a literal would be duplicated, and the body uses no global
+ * that the call site hides. A body with a case or a ccall runs as soon as
+ * it is reached, so it is only inlined where the call would have been
+ * evaluated anyway: in tail position, as a scrutinee, as a ccall argument
+ * or as an operand of a primitive in such a place. A constant that is a partial application, like
+ * digit = (+ 48), is inlined into calls of it.
+ */
+static int inline_limit = 16;
+static int inline_count;
+static int fresh_count;
+typedef unordered_map<Name, const Function*> Functions;
+static unordered_map<Name, int> arities; // of every global that takes arguments
+static Vars constructors;
+/*
+ * Names bound to values, like an Environment: a Scope takes back the
+ * bindings made while it lasts, so case alternatives and lets share one
+ * table instead of copying it.
+ */
+template <class T> class Bindings
+{
+public:
+	const T* find(Name name) const
+	{
+		auto i_value = values.find(name);
+		return i_value == values.end() ? nullptr : &i_value->second;
+	}
+	void bind(Name name, const T& value)
+	{
+		save(name);
+		values[name] = value;
+	}
+	void unbind(Name name)
+	{
+		if (values.count(name))
+		{
+			save(name);
+			values.erase(name);
+		}
+	}
+	auto begin() const { return values.begin(); }
+	auto end() const { return values.end(); }
+	class Scope
+	{
+	public:
+		Scope(Bindings& bindings) : bindings(bindings), mark(bindings.undo.size()) {}
+		~Scope() { bindings.restore(mark); }
+	private:
+		Bindings& bindings;
+		size_t mark;
+	};
+private:
+	unordered_map<Name, T> values;
+	// a name's value before each change, none if it had none
+	vector<pair<Name, optional<T>>> undo;
+	void save(Name name)
+	{
+		auto i_value = values.find(name);
+		undo.push_back({ name, i_value == values.end() ? nullopt : optional<T>(i_value->second) });
+	}
+	void restore(size_t mark)
+	{
+		while (undo.size() > mark)
+		{
+			auto& [name, value] = undo.back();
+			if (value)
+				values[name] = *value;
+			else
+				values.erase(name);
+			undo.pop_back();
+		}
+	}
+};
+typedef Bindings<const Node*> Subst;
+static int node_size(const Node* node)
+{
+	int size = 1;
+	if (const Apply* apply = kind_cast<Apply>(node))
+	{
+		size += node_size(apply->to_apply);
+		for (auto arg : apply->arguments)
+			size += node_size(arg);
+	}
+	else if (const Case* case_expr = kind_cast<Case>(node))
+	{
+		size += node_size(case_expr->scrutinee);
+		for (auto pat_expr : case_expr->patExprs)
+			size += 1 + node_size(pat_expr.expr);
+	}
+	else if (const Let* let = kind_cast<Let>(node))
+	{
+		size += node_size(let->body);
+		for (auto binding : let->bindings)
+			size += 1 + node_size(binding.expr);
+	}
+	else if (const Ccall* ccall = kind_cast<Ccall>(node))
+	{
+		for (auto arg : ccall->arguments)
+			size += node_size(arg);
+	}
+	return size;
+}
+// a case or a ccall runs as soon as the code reaches it
+static bool eager(const Node* node)
+{
+	if (kind_cast<Case>(node) || kind_cast<Ccall>(node))
+		return true;
+	if (const Apply* apply = kind_cast<Apply>(node))
+	{
+		if (eager(apply->to_apply))
+			return true;
+		for (auto arg : apply->arguments)
+			if (eager(arg))
+				return true;
+	}
+	if (const Let* let = kind_cast<Let>(node))
+	{
+		if (eager(let->body))
+			return true;
+		for (auto binding : let->bindings)
+			if (eager(binding.expr))
+				return true;
+	}
+	return false;
+}
+// The names an expression uses that it does not bind itself, with the
+// number of times each is used.
+static void free_names(const Node* node, Vars& bound, Uses& names)
+{
+	if (const Var* var = kind_cast<Var>(node))
+	{
+		if (!bound.count(var->id))
+			names[var->id]++;
+	}
+	else if (const Operator* op = kind_cast<Operator>(node))
+		names[op->id]++;
+	else if (const Apply* apply = kind_cast<Apply>(node))
+	{
+		free_names(apply->to_apply, bound, names);
+		for (auto arg : apply->arguments)
+			free_names(arg, bound, names);
+	}
+	else if (const Case* case_expr = kind_cast<Case>(node))
+	{
+		free_names(case_expr->scrutinee, bound, names);
+		for (auto pat_expr : case_expr->patExprs)
+		{
+			LocalScope scope(bound);
+			for (auto name : pattern_vars(pat_expr.pat))
+				scope.add(name);
+			free_names(pat_expr.expr, bound, names);
+		}
+	}
+	else if (const Let* let = kind_cast<Let>(node))
+	{
+		LocalScope scope(bound);
+		for (auto binding : let->bindings)
+			if (let->recursive)
+				scope.add(binding.name);
+		for (auto binding : let->bindings)
+		{
+			free_names(binding.expr, bound, names);
+			scope.add(binding.name);
+		}
+		free_names(let->body, bound, names);
+	}
+	else if (const Ccall* ccall = kind_cast<Ccall>(node))
+	{
+		for (auto arg : ccall->arguments)
+			free_names(arg, bound, names);
+	}
+}
+static Uses free_names(const Node* node)
+{
+	Vars bound;
+	Uses names;
+	free_names(node, bound, names);
+	return names;
+}
+static bool recursive(Name id, const Functions& functions)
+{
+	Vars seen;
+	vector<Name> todo = { id };
+	while (!todo.empty())
+	{
+		auto i_function = functions.find(todo.back());
+		todo.pop_back();
+		if (i_function == functions.end())
+			continue;
+		const Function* function = i_function->second;
+		Vars bound(function->arguments.begin(), function->arguments.end());
+		Uses names;
+		free_names(function->body, bound, names);
+		for (auto name : names)
+		{
+			if (name.first == id)
+				return true;
+			if (seen.insert(name.first).second)
+				todo.push_back(name.first);
+		}
+	}
+	return false;
+}
+// A copy of a pattern with fresh names for its variables, which subst
+// then renames.
+static Node* fresh_pattern(const Node* pat, Subst& subst)
+{
+	if (const CtorPat* ctor_pat = kind_cast<CtorPat>(pat))
+	{
+		CtorPat* fresh = new CtorPat(ctor_pat->id);
+		for (auto ctor_arg : ctor_pat->arguments)
+		{
+			string name = ctor_arg + "." + to_string(++fresh_count);
+			fresh->arguments.push_back(name);
+			subst.bind(ctor_arg, new Var(name));
+		}
+		return fresh;
+	}
+	if (const Var* var = kind_cast<Var>(pat))
+	{
+		string name = var->id + "." + to_string(++fresh_count);
+		subst.bind(var->id, new Var(name));
+		return new Var(name);
+	}
+	return const_cast<Node*>(pat);
+}
+// Copy an expression, replacing variables as subst says. Pattern
+// variables get fresh names so they cannot capture a substituted name.
+static Node* substitute(const Node* node, Subst& subst)
+{
+	if (const Var* var = kind_cast<Var>(node))
+	{
+		const Node* const* value = subst.find(var->id);
+		if (!value)
+			return const_cast<Var*>(var);
+		Subst none;
+		return substitute(*value, none);
+	}
+	if (const Apply* apply = kind_cast<Apply>(node))
+	{
+		Apply* copy = new Apply();
+		copy->to_apply = substitute(apply->to_apply, subst);
+		// (+ 48) c is + 48 c
+		if (Apply* head = kind_cast<Apply>(copy->to_apply))
+		{
+			copy->to_apply = head->to_apply;
+			copy->arguments = head->arguments;
+		}
+		for (auto arg : apply->arguments)
+			copy->arguments.push_back(substitute(arg, subst));
+		return copy;
+	}
+	if (const Case* case_expr = kind_cast<Case>(node))
+	{
+		Case* copy = new Case(substitute(case_expr->scrutinee, subst));
+		for (auto pat_expr : case_expr->patExprs)
+		{
+			Subst::Scope scope(subst);
+			Node* pat = fresh_pattern(pat_expr.pat, subst);
+			copy->patExprs.push_back({ pat, substitute(pat_expr.expr, subst) });
+		}
+		return copy;
+	}
+	if (const Let* let = kind_cast<Let>(node))
+	{
+		Let* copy = new Let(let->recursive);
+		Subst::Scope scope(subst);
+		vector<string> names;
+		for (auto binding : let->bindings)
+		{
+			names.push_back(binding.name + "." + to_string(++fresh_count));
+			if (let->recursive)
+				subst.bind(binding.name, new Var(names.back()));
+		}
+		for (int i=0; i<let->bindings.size(); ++i)
+		{
+			copy->bindings.push_back({ names[i], substitute(let->bindings[i].expr, subst) });
+			subst.bind(let->bindings[i].name, new Var(names[i]));
+		}
+		copy->body = substitute(let->body, subst);
+		return copy;
+	}
+	if (const Ccall* ccall = kind_cast<Ccall>(node))
+	{
+		Ccall* copy = new Ccall();
+		copy->c_id = ccall->c_id;
+		for (auto arg : ccall->arguments)
+			copy->arguments.push_back(substitute(arg, subst));
+		return copy;
+	}
+	return const_cast<Node*>(node);
+}
+// A copy of an expression, with fresh names for the variables it binds.
+static Node* substitute(const Node* node)
+{
+	Subst none;
+	return substitute(node, none);
+}
+// A copy of an expression with name replaced by value.
+static Node* substitute(const Node* node, Name name, const Node* value)
+{
+	Subst subst;
+	subst.bind(name, value);
+	return substitute(node, subst);
+}
+static bool atomic(const Node* node)
+{
+	return kind_cast<Var>(node) || kind_cast<Num>(node)
+		|| kind_cast<Str>(node) || kind_cast<Operator>(node);
+}
+// The inlined body of a call, or null if it should stay a call.
+static Node* inline_call(const Apply* apply, bool evaluated, const Vars& locals, const Functions& functions)
+{
+	const Var* head = kind_cast<Var>(apply->to_apply);
+	if (!head || locals.count(head->id))
+		return nullptr;
+	auto i_function = functions.find(head->id);
+	if (i_function == functions.end())
+		return nullptr;
+	const Function* function = i_function->second;
+	const Node* body = function->body;
+	// a constant may be copied if it is a name or a partial application,
+	// which are values; anything else would be computed at every call
+	bool value = false;
+	if (function->arguments.empty())
+	{
+		const Apply* partial = kind_cast<Apply>(body);
+		const Var* name = kind_cast<Var>(partial ? partial->to_apply : body);
+		const Operator* op = partial ? kind_cast<Operator>(partial->to_apply) : nullptr;
+		Name id = name ? name->id : op ? op->id : Name();
+		value = !partial || (arities.count(id) && partial->arguments.size() < arities[id]);
+		value = value && !id.empty();
+	}
+	if (function->arguments.size() != apply->arguments.size() && !value)
+		return nullptr;
+	if (node_size(body) > inline_limit || (eager(body) && !evaluated))
+		return nullptr;
+	Vars params(function->arguments.begin(), function->arguments.end());
+	Uses names;
+	free_names(body, params, names);
+	for (auto name : names)
+		if (locals.count(name.first))
+			return nullptr;
+	Uses uses = free_names(body);
+	Subst subst;
+	for (int i=0; i<function->arguments.size(); ++i)
+	{
+		Name param = function->arguments[i];
+		if (!atomic(apply->arguments[i]) && uses[param] > 1)
+			return nullptr;
+		subst.bind(param, apply->arguments[i]);
+	}
+	if (recursive(head->id, functions))
+		return nullptr;
+	++inline_count;
+	if (!value)
+		return substitute(body, subst);
+	Apply* call = new Apply();
+	call->to_apply = const_cast<Node*>(body);
+	call->arguments = apply->arguments;
+	return substitute(call, subst);
+}
+static Node* inline_calls(Node* node, bool evaluated, Vars& locals, const Functions& functions, int depth)
+{
+	if (Apply* apply = kind_cast<Apply>(node))
+	{
+		// a primitive forces its operands when it is evaluated
+		Name id = head_id(apply);
+		bool operands = evaluated && !locals.count(id)
+			&& (arithmetic.count(id) || comparison.count(id));
+		apply->to_apply = inline_calls(apply->to_apply, false, locals, functions, depth);
+		for (auto& arg : apply->arguments)
+			arg = inline_calls(arg, operands, locals, functions, depth);
+		if (depth < 8)
+			if (Node* body = inline_call(apply, evaluated, locals, functions))
+				return inline_calls(body, evaluated, locals, functions, depth+1);
+	}
+	else if (Case* case_expr = kind_cast<Case>(node))
+	{
+		case_expr->scrutinee = inline_calls(case_expr->scrutinee, true, locals, functions, depth);
+		for (auto& pat_expr : case_expr->patExprs)
+		{
+			LocalScope scope(locals);
+			for (auto name : pattern_vars(pat_expr.pat))
+				scope.add(name);
+			pat_expr.expr = inline_calls(pat_expr.expr, evaluated, locals, functions, depth);
+		}
+	}
+	else if (Let* let = kind_cast<Let>(node))
+	{
+		LocalScope scope(locals);
+		for (auto binding : let->bindings)
+			scope.add(binding.name);
+		// a binding is only built, not evaluated
+		for (auto& binding : let->bindings)
+			binding.expr = inline_calls(binding.expr, false, locals, functions, depth);
+		let->body = inline_calls(let->body, evaluated, locals, functions, depth);
+	}
+	else if (Ccall* ccall = kind_cast<Ccall>(node))
+	{
+		for (auto& arg : ccall->arguments)
+			arg = inline_calls(arg, true, locals, functions, depth);
+	}
+	return node;
+}
+void inline_definitions(Definitions& definitions)
+{
+	Functions functions;
+	for (const char* op : { ">", "<", ">=", "<=", "==", "*", "-", "%", "/", "+", "+#", "par", "seq" })
+		arities[op] = 2;
+	for (auto definition : definitions)
+		if (Function* function = kind_cast<Function>(definition->defineable))
+		{
+			if (function->body)
+				functions[definition->id] = function;
+			if (!function->arguments.empty())
+				arities[definition->id] = function->arguments.size();
+		}
+		else if (Type* type = kind_cast<Type>(definition->defineable))
+			for (auto& ctor : type->constructors)
+			{
+				constructors.insert(ctor.constructor);
+				if (!ctor.arguments.empty())
+					arities[ctor.constructor] = ctor.arguments.size();
+			}
+	if (inline_limit <= 0)
+		return;
+	for (auto definition : definitions)
+		if (Function* function = kind_cast<Function>(definition->defineable))
+		{
+			if (definition->imported)
+				continue;
+			Vars locals(function->arguments.begin(), function->arguments.end());
+			function->body = inline_calls(function->body, true, locals, functions, 0);
+		}
+}
+/*
+ * Simplification, after inlining. A case on a constructor application, on
+ * a variable whose constructor an enclosing alternative has matched, on
+ * a number or on a comparison of literals picks its alternative at
+ * compile time. A
+ * case on another case is pushed into the inner alternatives when they
+ * then resolve or the outer alternatives are small. Alternatives that
+ * repeat an earlier pattern can never match and are dropped. A let
+ * binding used once is moved to where it is used. Otherwise
+ * only cases whose patterns are all constructors are touched.
+ */
+static int simplify_count;
+struct Known {
+	Name ctor;
+	vector<Node*> args;
+};
+typedef Bindings<Known> Knowledge;
+static bool known_ctor(const Node* node, const Knowledge& known, Known& value)
+{
+	if (const Var* var = kind_cast<Var>(node))
+	{
+		if (const Known* matched = known.find(var->id))
+		{
+			value = *matched;
+			return true;
+		}
+		if (constructors.count(var->id) && !arities.count(var->id))
+		{
+			value = { var->id, {} };
+			return true;
+		}
+		return false;
+	}
+	const Apply* apply = kind_cast<Apply>(node);
+	if (!apply)
+		return false;
+	// a comparison of two literals
+	Name id = head_id(apply);
+	if (comparison.count(id) && apply->arguments.size() == 2 && constructors.count("True"))
+	{
+		const Num* left = kind_cast<Num>(apply->arguments[0]);
+		const Num* right = kind_cast<Num>(apply->arguments[1]);
+		if (!left || !right)
+			return false;
+		bool integers = left->integer && right->integer;
+		int order = integers ? (left->ivalue > right->ivalue) - (left->ivalue < right->ivalue)
+			: (left->value > right->value) - (left->value < right->value);
+		bool result = id == ">" ? order > 0 : id == "<" ? order < 0
+			: id == ">=" ? order >= 0 : id == "<=" ? order <= 0 : order == 0;
+		value = { result ? "True" : "False", {} };
+		return true;
+	}
+	const Var* head = kind_cast<Var>(apply->to_apply);
+	if (!head || !constructors.count(head->id) || !arities.count(head->id)
+			|| apply->arguments.size() != arities[head->id])
+		return false;
+	value = { head->id, apply->arguments.to_vector() };
+	return true;
+}
+// constructors, perhaps with a variable as the last, default, pattern
+static bool ctor_alternatives(const Case* case_expr)
+{
+	for (auto i_alt = case_expr->patExprs.begin(); i_alt != case_expr->patExprs.end(); ++i_alt)
+		if (!kind_cast<CtorPat>(i_alt->pat)
+				&& !(kind_cast<Var>(i_alt->pat) && next(i_alt) == case_expr->patExprs.end()))
+			return false;
+	return true;
+}
+// The alternative value selects, with its pattern variables replaced by
+// the constructor's arguments, or null if there is none or an argument
+// would be copied.
+static Node* select(const Case* case_expr, const Known& value)
+{
+	for (auto pat_expr : case_expr->patExprs)
+	{
+		CtorPat* ctor_pat = kind_cast<CtorPat>(pat_expr.pat);
+		if (!ctor_pat)
+		{
+			// the default stands for the scrutinee itself
+			Name name = kind_cast<Var>(pat_expr.pat)->id;
+			Uses uses = free_names(pat_expr.expr);
+			if (!atomic(case_expr->scrutinee) && uses[name] > 1)
+				return nullptr;
+			return substitute(pat_expr.expr, name, case_expr->scrutinee);
+		}
+		if (ctor_pat->id != value.ctor)
+			continue;
+		if (ctor_pat->arguments.size() != value.args.size())
+			return nullptr;
+		Uses uses = free_names(pat_expr.expr);
+		Subst subst;
+		for (int i=0; i<value.args.size(); ++i)
+		{
+			Name name = ctor_pat->arguments[i];
+			if (!atomic(value.args[i]) && uses[name] > 1)
+				return nullptr;
+			subst.bind(name, value.args[i]);
+		}
+		return substitute(pat_expr.expr, subst);
+	}
+	return nullptr;
+}
+// case (case x of { p -> e; ... }) of alts
+//   => case x of { p -> case e of alts; ... }
+static Node* case_of_case(const Case* outer, const Knowledge& known)
+{
+	const Case* inner = kind_cast<Case>(outer->scrutinee);
+	if (!inner || !ctor_alternatives(inner) || !ctor_alternatives(outer))
+		return nullptr;
+	int outer_size = 0;
+	for (auto pat_expr : outer->patExprs)
+		outer_size += node_size(pat_expr.expr);
+	bool resolves = true;
+	Known value;
+	for (auto pat_expr : inner->patExprs)
+		resolves = resolves && known_ctor(pat_expr.expr, known, value);
+	if (!resolves && outer_size > inline_limit)
+		return nullptr;
+	Case* pushed = new Case(inner->scrutinee);
+	for (auto pat_expr : inner->patExprs)
+	{
+		// fresh names for the inner pattern, which now scopes over the
+		// outer alternatives too
+		Subst subst;
+		Node* fresh = fresh_pattern(pat_expr.pat, subst);
+		Case* copy = new Case(substitute(pat_expr.expr, subst));
+		for (auto outer_alt : outer->patExprs)
+		{
+			Subst alt_subst;
+			Node* outer_fresh = fresh_pattern(outer_alt.pat, alt_subst);
+			copy->patExprs.push_back({ outer_fresh, substitute(outer_alt.expr, alt_subst) });
+		}
+		pushed->patExprs.push_back({ fresh, copy });
+	}
+	return pushed;
+}
+// Forgets what mentions the names bound where they are rebound, until the
+// caller's scope ends.
+static void hide(Knowledge& known, const Vars& bound)
+{
+	vector<Name> hidden;
+	for (auto& [name, value] : known)
+	{
+		bool mentioned = bound.count(name);
+		for (auto arg : value.args)
+			for (auto use : free_names(arg))
+				mentioned = mentioned || bound.count(use.first);
+		if (mentioned)
+			hidden.push_back(name);
+	}
+	for (auto name : hidden)
+		known.unbind(name);
+}
+static Node* simplify(Node* node, Knowledge& known)
+{
+	if (Apply* apply = kind_cast<Apply>(node))
+	{
+		apply->to_apply = simplify(apply->to_apply, known);
+		for (auto& arg : apply->arguments)
+			arg = simplify(arg, known);
+	}
+	else if (Ccall* ccall = kind_cast<Ccall>(node))
+	{
+		for (auto& arg : ccall->arguments)
+			arg = simplify(arg, known);
+	}
+	else if (Let* let = kind_cast<Let>(node))
+	{
+		// let a = x; b = y in e is let a = x in let b = y in e
+		if (!let->recursive && let->bindings.size() > 1)
+		{
+			Let* rest = new Let(false);
+			rest->bindings.assign(let->bindings.begin()+1, let->bindings.end());
+			rest->body = let->body;
+			let->bindings.resize(1);
+			let->body = rest;
+		}
+		// a let binding that is used once moves to its use, where it may
+		// only be needed on some paths, and one that is not used goes
+		Let::Binding binding = let->bindings.front();
+		if (!let->recursive && !eager(binding.expr))
+		{
+			Uses uses = free_names(let->body);
+			if (uses[binding.name] == 0)
+			{
+				++simplify_count;
+				return simplify(let->body, known);
+			}
+			if (uses[binding.name] == 1 || atomic(binding.expr))
+			{
+				++simplify_count;
+				return simplify(substitute(let->body, binding.name, binding.expr), known);
+			}
+		}
+		Vars bound;
+		for (auto binding : let->bindings)
+			bound.insert(binding.name);
+		Knowledge::Scope scope(known);
+		hide(known, bound);
+		for (auto& binding : let->bindings)
+			binding.expr = simplify(binding.expr, known);
+		let->body = simplify(let->body, known);
+	}
+	else if (Case* case_expr = kind_cast<Case>(node))
+	{
+		case_expr->scrutinee = simplify(case_expr->scrutinee, known);
+		// a number picks its literal alternative, or the default
+		if (Num* num = kind_cast<Num>(case_expr->scrutinee))
+			for (auto pat_expr : case_expr->patExprs)
+			{
+				Num* lit = kind_cast<Num>(pat_expr.pat);
+				Var* var = kind_cast<Var>(pat_expr.pat);
+				bool same = lit && (lit->integer && num->integer
+					? lit->ivalue == num->ivalue : lit->value == num->value);
+				if (!same && !var)
+					continue;
+				Subst subst;
+				if (var)
+					subst.bind(var->id, num);
+				++simplify_count;
+				return simplify(substitute(pat_expr.expr, subst), known);
+			}
+		if (!ctor_alternatives(case_expr))
+			return case_expr;
+		Known value;
+		if (known_ctor(case_expr->scrutinee, known, value))
+			if (Node* selected = select(case_expr, value))
+			{
+				++simplify_count;
+				return simplify(selected, known);
+			}
+		if (Node* pushed = case_of_case(case_expr, known))
 		{
-			//LOG("");
-			Node* arg = parse_primary(parser, in);
-			Ccall* call = new Ccall();
-			call->c_id = id->id;
-			call->arguments.push_back(arg);
-			//LOG("");
-			return call;
+			++simplify_count;
+			return simplify(pushed, known);
+		}
+		Vars seen;
+		for (auto i_alt = case_expr->patExprs.begin(); i_alt != case_expr->patExprs.end(); )
+		{
+			CtorPat* ctor_pat = kind_cast<CtorPat>(i_alt->pat);
+			if (ctor_pat && !seen.insert(ctor_pat->id).second)
+			{
+				++simplify_count;
+				i_alt = case_expr->patExprs.erase(i_alt);
+				continue;
+			}
+			// inside the alternative the scrutinee is known, and whatever
+			// mentions a name the pattern rebinds is not
+			vector<Name> pat_vars = pattern_vars(i_alt->pat);
+			Vars bound(pat_vars.begin(), pat_vars.end());
+			Knowledge::Scope scope(known);
+			hide(known, bound);
+			Var* var = kind_cast<Var>(case_expr->scrutinee);
+			if (ctor_pat && var && !bound.count(var->id) && !constructors.count(var->id))
+			{
+				Known matched = { ctor_pat->id, {} };
+				for (auto ctor_arg : ctor_pat->arguments)
+					matched.args.push_back(new Var(ctor_arg));
+				known.bind(var->id, matched);
+			}
+			i_alt->expr = simplify(i_alt->expr, known);
+			++i_alt;
+		}
+	}
+	return node;
+}
+void simplify_definitions(Definitions& definitions)
+{
+	for (auto definition : definitions)
+		if (Function* function = kind_cast<Function>(definition->defineable))
+			if (!definition->imported)
+			{
+				Knowledge known;
+				function->body = simplify(function->body, known);
+			}
+}
+/*
+ * Pattern matching, before inlining. A case whose patterns nest, are
+ * numbers or are variables becomes a decision tree of cases that each
+ * look at one value once: every alternative is a constructor with
+ * variables, or a number, with a variable last for anything else. The
+ * rows are matched a column at a time, left to right, as in Wadler's
+ * chapter of "The Implementation of Functional Programming Languages";
+ * rows that fall through continue with the rows after them. A value that
+ * no row matches reaches a fail, which stops the program.
+ */
+static unordered_map<Name, const Type*> ctor_types;
+struct Row {
+	vector<Node*> pats;
+	Node* expr;
+};
+typedef list<Row> Rows;
+enum PatternKind { PK_VAR, PK_CTOR, PK_NUM };
+static PatternKind pattern_kind(const Node* pat)
+{
+	if (kind_cast<CtorPat>(pat) || kind_cast<Ctor>(pat))
+		return PK_CTOR;
+	if (kind_cast<Num>(pat))
+		return PK_NUM;
+	if (kind_cast<Var>(pat))
+		return PK_VAR;
+	throw Error(definition_line, "unsupported pattern");
+}
+static Node* match(const vector<Node*>& values, const Rows& rows, Node* fail);
+// The rows of a run all start with the same kind of pattern.
+static Node* match_run(const vector<Node*>& values, const Rows& rows, Node* fail)
+{
+	Node* value = values.front();
+	vector<Node*> rest(values.begin()+1, values.end());
+	PatternKind kind = pattern_kind(rows.front().pats.front());
+	if (kind == PK_VAR)
+	{
+		Rows next;
+		for (auto row : rows)
+		{
+			Name name = kind_cast<Var>(row.pats.front())->id;
+			Node* expr = row.expr;
+			if (name != "_")
+				expr = substitute(expr, name, value);
+			next.push_back({ vector<Node*>(row.pats.begin()+1, row.pats.end()), expr });
+		}
+		return match(rest, next, fail);
+	}
+	Case* case_expr = new Case(value);
+	if (kind == PK_NUM)
+	{
+		vector<pair<Num*, Rows> > groups;
+		for (auto row : rows)
+		{
+			Num* num = kind_cast<Num>(row.pats.front());
+			auto i_group = groups.begin();
+			while (i_group != groups.end() && !(i_group->first->integer == num->integer
+					&& i_group->first->ivalue == num->ivalue && i_group->first->value == num->value))
+				++i_group;
+			if (i_group == groups.end())
+				i_group = groups.insert(groups.end(), { num, Rows() });
+			i_group->second.push_back({ vector<Node*>(row.pats.begin()+1, row.pats.end()), row.expr });
+		}
+		for (auto group : groups)
+			case_expr->patExprs.push_back({ group.first, match(rest, group.second, fail) });
+		case_expr->patExprs.push_back({ new Var("_"), substitute(fail) });
+		return case_expr;
+	}
+	vector<Name> order;
+	map<Name, Rows> groups;
+	for (auto row : rows)
+	{
+		Name id;
+		vector<Node*> fields;
+		if (CtorPat* ctor_pat = kind_cast<CtorPat>(row.pats.front()))
+		{
+			id = ctor_pat->id;
+			for (auto name : ctor_pat->arguments)
+				fields.push_back(new Var(name));
 		}
 		else
-			throw Error(line_number, "ccall only works with a few c functions");
+		{
+			Ctor* ctor = kind_cast<Ctor>(row.pats.front());
+			id = ctor->id;
+			fields = ctor->arguments.to_vector();
+		}
+		auto i_type = ctor_types.find(id);
+		if (i_type == ctor_types.end())
+			throw Error(definition_line, "undefined constructor " + id + " in pattern");
+		for (auto& ctor : i_type->second->constructors)
+			if (ctor.constructor == id && ctor.arguments.size() != fields.size())
+				throw Error(definition_line, "constructor " + id + " takes "
+					+ to_string(ctor.arguments.size()) + " arguments in a pattern");
+		if (!groups.count(id))
+			order.push_back(id);
+		fields.insert(fields.end(), row.pats.begin()+1, row.pats.end());
+		groups[id].push_back({ fields, row.expr });
 	}
-	return nullptr;
+	for (auto id : order)
+	{
+		const Rows& group = groups[id];
+		int arity = group.front().pats.size() - rest.size();
+		// a lone row of variables keeps its names; it cannot fall through
+		// to fail, which might mean something else by them
+		bool names = group.size() == 1;
+		for (auto pat : group.front().pats)
+			names = names && kind_cast<Var>(pat);
+		CtorPat* ctor_pat = new CtorPat(id);
+		vector<Node*> fields;
+		for (int i=0; i<arity; ++i)
+		{
+			Name name = names ? kind_cast<Var>(group.front().pats[i])->id
+				: Name(id + "." + to_string(++fresh_count));
+			ctor_pat->arguments.push_back(name);
+			fields.push_back(new Var(name));
+		}
+		fields.insert(fields.end(), rest.begin(), rest.end());
+		case_expr->patExprs.push_back({ ctor_pat, match(fields, group, fail) });
+	}
+	if (order.size() < ctor_types[order.front()]->constructors.size())
+		case_expr->patExprs.push_back({ new Var("_"), substitute(fail) });
+	return case_expr;
 }
-Node* parse_primary(Parser& parser, istream& in)
+static Node* match(const vector<Node*>& values, const Rows& rows, Node* fail)
 {
-	Node* primary = nullptr;
-	//LOG(parser.token);
-	if (parser.token.type == TT_LPAREN)
+	if (rows.empty())
+		return substitute(fail);
+	if (values.empty())
+		return rows.front().expr;
+	// each run falls through to the runs after it
+	vector<Rows> runs;
+	for (auto row : rows)
 	{
-		parser.next(in);
-		primary = parse_expr(parser,in);
-		if (parser.token.type != TT_RPAREN)
-			throw Error(line_number,"left '(' not matched");
-		parser.next(in);
+		if (runs.empty() || pattern_kind(row.pats.front()) != pattern_kind(runs.back().front().pats.front()))
+			runs.push_back(Rows());
+		runs.back().push_back(row);
 	}
-	else if (parser.token.type == TT_CASE)
+	for (auto i_run = runs.rbegin(); i_run != runs.rend(); ++i_run)
+		fail = match_run(values, *i_run, fail);
+	return fail;
+}
+static Node* compile_matches(Node* node)
+{
+	if (Apply* apply = kind_cast<Apply>(node))
 	{
-		primary = parse_case(parser, in);
+		apply->to_apply = compile_matches(apply->to_apply);
+		for (auto& arg : apply->arguments)
+			arg = compile_matches(arg);
 	}
-	if (!primary)
-		primary = parse_ccall(parser,in);
-	if (!primary)
-		primary = parse_var(parser,in);
-	if (!primary) // an application could be an id but isn't always
-		primary = parse_con(parser,in);
-	if (!primary)
-		primary = parse_oper(parser,in);
-	if (!primary)
-		throw Error(line_number,string("[937] Expected variable, constructor or operator ")+TokenTypeStr[parser.token.type]);
-	return primary;
+	else if (Ccall* ccall = kind_cast<Ccall>(node))
+	{
+		for (auto& arg : ccall->arguments)
+			arg = compile_matches(arg);
+	}
+	else if (Case* case_expr = kind_cast<Case>(node))
+	{
+		Node* scrutinee = compile_matches(case_expr->scrutinee);
+		Rows rows;
+		bool named = false;
+		for (auto pat_expr : case_expr->patExprs)
+		{
+			rows.push_back({ { pat_expr.pat }, compile_matches(pat_expr.expr) });
+			named = named || pattern_kind(pat_expr.pat) == PK_VAR;
+		}
+		if (kind_cast<Var>(scrutinee) || !named)
+			return match({ scrutinee }, rows, new Fail());
+		// a variable pattern needs a name for the value
+		string name = "case." + to_string(++fresh_count);
+		Case* named_case = new Case(scrutinee);
+		named_case->patExprs.push_back({ new Var(name), match({ new Var(name) }, rows, new Fail()) });
+		return named_case;
+	}
+	else if (Let* let = kind_cast<Let>(node))
+	{
+		for (auto& binding : let->bindings)
+			binding.expr = compile_matches(binding.expr);
+		let->body = compile_matches(let->body);
+	}
+	return node;
 }
-Node* parse_expr(Parser& parser, istream& in)
+void compile_matches(Definitions& definitions)
 {
-	//LOG(parser.token);
-	Node* literal = parse_literal(parser, in);
-	if (literal)
-		return literal; // A literal cannot be applied as a function
-
-	//LOG(parser.token);
-	Node* apply = parse_primary(parser,in);
-	vector<Node*> arguments;
-	while (parser.token.type != TT_SEMI && parser.token.type != TT_RPAREN && parser.token.type != TT_OF && parser.token.text != "}" && parser.token.type != TT_EOF)
+	for (auto definition : definitions)
+		if (Type* type = kind_cast<Type>(definition->defineable))
+			for (auto& ctor : type->constructors)
+				ctor_types[ctor.constructor] = type;
+	for (auto definition : definitions)
+		if (Function* function = kind_cast<Function>(definition->defineable))
+		{
+			if (!function->body)
+				continue;
+			definition_line = definition->line;
+			function->body = compile_matches(function->body);
+		}
+}
+/*
+ * Dead code, after simplification. Only what main reaches is generated:
+ * the functions it names, directly or through other functions, and the
+ * types whose constructors those build or match, each with all of its
+ * constructors so that the tags stay the same. The runtime itself needs
+ * True, False, Nil and Cons. The rest is neither analysed nor generated,
+ * so errors in it go unreported. A module has no main and keeps
+ * everything, as does --keep-unused. What is left out is summarised on
+ * stderr.
+ */
+static bool keep_unused;
+static void referenced_names(const Node* node, set<Name>& names)
+{
+	if (const Var* var = kind_cast<Var>(node))
+		names.insert(var->id);
+	else if (const Operator* op = kind_cast<Operator>(node))
+		names.insert(op->id);
+	else if (const Ctor* ctor = kind_cast<Ctor>(node))
 	{
-		Node* argument = parse_literal(parser,in);
-		if (!argument) { 		//LOG(parser.token);
-			argument = parse_primary(parser,in); }
-		//LOG("An argument " << *argument);
-		if (argument)
-			arguments.push_back(argument);
+		names.insert(ctor->id);
+		for (auto arg : ctor->arguments)
+			referenced_names(arg, names);
 	}
-	if (arguments.size()==0)
-		return apply;
-	Apply* application = new Apply();
-	application->to_apply = apply;
-	application->arguments = arguments;
-	return application;
+	else if (const CtorPat* ctor_pat = kind_cast<CtorPat>(node))
+		names.insert(ctor_pat->id);
+	else if (const Apply* apply = kind_cast<Apply>(node))
+	{
+		referenced_names(apply->to_apply, names);
+		for (auto arg : apply->arguments)
+			referenced_names(arg, names);
+	}
+	else if (const Case* case_expr = kind_cast<Case>(node))
+	{
+		referenced_names(case_expr->scrutinee, names);
+		for (auto pat_expr : case_expr->patExprs)
+		{
+			referenced_names(pat_expr.pat, names);
+			referenced_names(pat_expr.expr, names);
+		}
+	}
+	else if (const Let* let = kind_cast<Let>(node))
+	{
+		for (auto binding : let->bindings)
+			referenced_names(binding.expr, names);
+		referenced_names(let->body, names);
+	}
+	else if (const Ccall* ccall = kind_cast<Ccall>(node))
+	{
+		for (auto arg : ccall->arguments)
+			referenced_names(arg, names);
+	}
+}
+static void report_unused(const char* what, const vector<Name>& names)
+{
+	cerr << names.size() << ' ' << what << (names.size() == 1 ? "" : "s");
+	for (size_t i=0; i<names.size() && i<8; ++i)
+		cerr << (i ? ", " : " (") << names[i];
+	if (names.size() > 8)
+		cerr << ", ...";
+	if (!names.empty())
+		cerr << ')';
+}
+void mark_unused(Definitions& definitions)
+{
+	// the definition behind each function and constructor
+	map<Name, const Definition*> owner;
+	for (auto definition : definitions)
+	{
+		owner[definition->id] = definition;
+		if (const Type* type = kind_cast<Type>(definition->defineable))
+			for (auto& ctor : type->constructors)
+				owner[ctor.constructor] = definition;
+	}
+	auto i_main = owner.find("main");
+	if (i_main == owner.end() || !kind_cast<Function>(i_main->second->defineable))
+		return;
+	set<const Definition*> live;
+	vector<Name> todo = { "main", "True", "False", "Nil", "Cons" };
+	while (!todo.empty())
+	{
+		auto i_owner = owner.find(todo.back());
+		todo.pop_back();
+		if (i_owner == owner.end() || !live.insert(i_owner->second).second)
+			continue;
+		const Function* function = kind_cast<Function>(i_owner->second->defineable);
+		if (function && function->body)
+		{
+			set<Name> names;
+			referenced_names(function->body, names);
+			todo.insert(todo.end(), names.begin(), names.end());
+		}
+	}
+	vector<Name> functions, types;
+	for (auto definition : definitions)
+		if (!live.count(definition))
+		{
+			definition->unused = true;
+			(kind_cast<Type>(definition->defineable) ? types : functions).push_back(definition->id);
+		}
+	if (functions.empty() && types.empty())
+		return;
+	cerr << "unused: ";
+	report_unused("function", functions);
+	cerr << " and ";
+	report_unused("type", types);
+	cerr << " not generated" << endl;
 }
 /*
- *
+ * Modules. dccsuper --interface=FILE compiles its input as a module and
+ * also writes FILE, which lists every type with the tags and fields of
+ * its constructors and every function with its arity, the arguments it
+ * is strict in and whether it has a worker. --import=FILE reads such an
+ * interface in place of the module's source: its definitions are known
+ * to the symbol table but declared extern instead of generated. Small
+ * non-recursive functions keep their source in the interface so that
+ * importers can still inline them. The C for a module or for a program
+ * that imports one includes dcc.h instead of being appended to base.c.
  */
-Definition* parse_data(Parser& parser, istream& in)
+static const char* interface_path;
+static vector<const char*> imports;
+static const string interface_magic = "dccsuper interface 1";
+static deque<string> interface_sources; // tokens of inline bodies point here
+static vector<Name> defined_names(const Definition* definition)
 {
-	parser.next(in);
-	Var* type_name = parse_con(parser, in);
-	if (type_name == nullptr)
-		throw Error(line_number, "expecting conid");
-	Definition* definition = new Definition();
-	definition->id = type_name->id;
-	Type* type = new Type();
-	while (parser.token.text != "=")
+	vector<Name> names = { definition->id };
+	if (const Type* type = kind_cast<Type>(definition->defineable))
+		for (auto& ctor : type->constructors)
+			names.push_back(ctor.constructor);
+	return names;
+}
+static void read_names(istream& in, ArenaVector<Name>& names, size_t count)
+{
+	string name;
+	while (names.size() < count && in >> name)
+		names.push_back(Name(name));
+	if (names.size() != count)
+		throw Error(0, "interface lists too few names");
+}
+static void read_interface(const char* path, Definitions& definitions)
+{
+	ifstream in(path);
+	if (!in)
+		throw Error(0, string("cannot open ") + path);
+	string line;
+	if (!getline(in, line) || line != interface_magic)
+		throw Error(0, string(path) + " is not a dccsuper interface");
+	int saved_line = line_number;
+	Type* type = nullptr;
+	Definition* function = nullptr;
+	while (getline(in, line))
 	{
-		Var* arg = parse_var(parser,in);
-		type->arguments.push_back(arg->id);
+		istringstream fields(line);
+		string kind, id;
+		size_t arity = 0;
+		fields >> kind >> id;
+		if (kind == "type")
+		{
+			Definition* definition = new Definition();
+			definition->id = Name(id);
+			definition->line = 0;
+			definition->imported = true;
+			type = new Type();
+			string arg;
+			while (fields >> arg)
+				type->arguments.push_back(Name(arg));
+			definition->defineable = type;
+			definitions.push_back(definition);
+		}
+		else if (kind == "ctor" && type)
+		{
+			// the tags are the order of the C enum the importer emits
+			size_t tag = 0;
+			fields >> tag >> arity;
+			if (tag != type->constructors.size())
+				throw Error(0, "constructor " + id + " is out of order in " + path);
+			type->constructors.emplace_back();
+			type->constructors.back().constructor = Name(id);
+			read_names(fields, type->constructors.back().arguments, arity);
+		}
+		else if (kind == "function")
+		{
+			function = new Definition();
+			function->id = Name(id);
+			function->line = 0;
+			function->imported = true;
+			Function* defined = new Function();
+			fields >> arity >> function->strict >> function->worker;
+			read_names(fields, defined->arguments, arity);
+			function->defineable = defined;
+			definitions.push_back(function);
+		}
+		else if (kind == "inline" && function)
+		{
+			string& text = interface_sources.emplace_back(stoul(id), '\0');
+			in.read(&text[0], text.size());
+			in.ignore(1);
+			Parser parser(text.data(), text.data() + text.size());
+			line_number = 0;
+			parser.next();
+			Definition* parsed = parse_function(parser);
+			if (parsed->id != function->id)
+				throw Error(0, "the inline body of " + function->id + " defines " + parsed->id);
+			kind_cast<Function>(function->defineable)->body = kind_cast<Function>(parsed->defineable)->body;
+		}
+		else if (!kind.empty())
+			throw Error(0, string(path) + ": cannot read " + line);
 	}
-	parser.next(in);
-	while (parser.token.type != TT_SEMI)
+	line_number = saved_line;
+}
+// Appends the program's definitions to the imported ones, none of which
+// it may define again.
+static void add_definitions(Definitions& definitions, Definitions& program)
+{
+	set<Name> imported;
+	for (auto definition : definitions)
+		for (auto name : defined_names(definition))
+			imported.insert(name);
+	for (auto definition : program)
+		for (auto name : defined_names(definition))
+			if (imported.count(name))
+				throw Error(definition->line, name + " is already defined by an imported interface");
+	definitions.splice(definitions.end(), program);
+}
+// Only what inline_calls could inline keeps its source: a small function
+// that does not call itself, as it stands before anything is inlined.
+static void keep_inline_sources(Definitions& definitions)
+{
+	Functions functions;
+	for (auto definition : definitions)
+		if (Function* function = kind_cast<Function>(definition->defineable))
+			if (function->body)
+				functions[definition->id] = function;
+	for (auto definition : definitions)
 	{
-		Var* conid = parse_con(parser,in);
-		Constructor* ctor = new Constructor();
-		ctor->constructor = conid->id;
-		while (parser.token.type != TT_SEMI && parser.token.type != TT_PIPE)
+		Function* function = kind_cast<Function>(definition->defineable);
+		if (!function || definition->imported || node_size(function->body) > inline_limit
+				|| recursive(definition->id, functions))
+			definition->source = string_view();
+	}
+}
+static void write_interface(const char* path, const Definitions& definitions)
+{
+	ofstream out(path);
+	out << interface_magic << endl;
+	for (auto definition : definitions)
+	{
+		if (definition->imported)
+			continue;
+		if (const Type* type = kind_cast<Type>(definition->defineable))
 		{
-			Var* apat = parse_var(parser, in);
-			if (apat == nullptr)
-				throw Error(line_number, "expecting apat (1192)");
-			ctor->arguments.push_back(apat->id);
+			out << "type " << definition->id;
+			for (auto arg : type->arguments)
+				out << ' ' << arg;
+			out << endl;
+			for (size_t tag=0; tag<type->constructors.size(); ++tag)
+			{
+				const Constructor& ctor = type->constructors[tag];
+				out << "ctor " << ctor.constructor << ' ' << tag << ' ' << ctor.arguments.size();
+				for (auto arg : ctor.arguments)
+					out << ' ' << arg;
+				out << endl;
+			}
 		}
-		type->constructors.push_back(*ctor);
-		if (parser.token.type == TT_PIPE)
+		else if (const Function* function = kind_cast<Function>(definition->defineable))
 		{
-			parser.next(in);
+			const Symbol& symbol = symbols.at(definition->id);
+			out << "function " << definition->id << ' ' << function->arguments.size()
+				<< ' ' << symbol.strict << ' ' << symbol.worker;
+			for (auto arg : function->arguments)
+				out << ' ' << arg;
+			out << endl;
+			if (!definition->source.empty())
+				out << "inline " << definition->source.size() << endl << definition->source << endl;
 		}
+	}
+	out.close();
+	if (!out)
+		throw Error(0, string("cannot write ") + path);
+}
+/*
+ * Code generation. Each definition only depends on itself and the symbol
+ * table, so definitions are rendered into buffers of their own on a pool
+ * of threads. The sections are then put together in definition order and
+ * written out at once.
+ */
+struct Rendering {
+	string prototype;
+	string info;
+	string definition;
+	vector<ConstantPool::Literal> literals;
+	exception_ptr error;
+	bool cached = false;
+};
+static int jobs; // threads for code generation, 0 for one per core
+/*
+ * Compile cache. With --cache=DIR the code generated for a definition is
+ * kept in DIR under a hash of everything it depends on: the definition as
+ * it stands after matching, inlining and simplification, its own
+ * strictness and worker, and the kind, arity, strictness and worker of
+ * every global it names. A later run that arrives at the same key reads
+ * the code back instead of generating it. The key is stored along with
+ * the code, so two keys with the same hash only cost a miss.
+ */
+static const char* cache_dir;
+// code from another build of the compiler is not reused
+static const string cache_stamp = "dccsuper " __DATE__ " " __TIME__;
+static void normal_form(ostream& out, const Node* node, set<Name>& globals)
+{
+	out << '(';
+	if (const Num* num = kind_cast<Num>(node))
+	{
+		if (num->integer)
+			out << "i " << num->ivalue;
 		else
+			out << "d " << setprecision(17) << num->value;
+	}
+	else if (const Var* var = kind_cast<Var>(node))
+	{
+		out << "v " << var->id;
+		globals.insert(var->id);
+	}
+	else if (const Str* str = kind_cast<Str>(node))
+		out << "s " << str->text.size() << ':' << str->text;
+	else if (const Operator* op = kind_cast<Operator>(node))
+	{
+		out << "o " << op->id;
+		globals.insert(op->id);
+	}
+	else if (const Ctor* ctor = kind_cast<Ctor>(node))
+	{
+		out << "c " << ctor->id;
+		globals.insert(ctor->id);
+		for (auto arg : ctor->arguments)
+			normal_form(out, arg, globals);
+	}
+	else if (const CtorPat* ctor_pat = kind_cast<CtorPat>(node))
+	{
+		out << "p " << ctor_pat->id;
+		globals.insert(ctor_pat->id);
+		for (auto arg : ctor_pat->arguments)
+			out << ' ' << arg;
+	}
+	else if (const Case* case_expr = kind_cast<Case>(node))
+	{
+		out << "case";
+		normal_form(out, case_expr->scrutinee, globals);
+		for (auto pat_expr : case_expr->patExprs)
 		{
-			break;
+			normal_form(out, pat_expr.pat, globals);
+			normal_form(out, pat_expr.expr, globals);
 		}
 	}
-	//LOG(parser.token);
-	parser.next(in);
-	//LOG(parser.token);
-	//LOG("Type " << *type);
-	definition->defineable = type;
-	//LOG("Defined: " << definition->id);
-	return definition;
-	//throw Error(line_number, "data keyword not implemented");
+	else if (const Let* let = kind_cast<Let>(node))
+	{
+		out << (let->recursive ? "letrec" : "let");
+		for (auto& binding : let->bindings)
+		{
+			out << ' ' << binding.name;
+			normal_form(out, binding.expr, globals);
+		}
+		normal_form(out, let->body, globals);
+	}
+	else if (kind_cast<Fail>(node))
+		out << "fail";
+	else if (const Apply* apply = kind_cast<Apply>(node))
+	{
+		out << "a";
+		normal_form(out, apply->to_apply, globals);
+		for (auto arg : apply->arguments)
+			normal_form(out, arg, globals);
+	}
+	else if (const Ccall* ccall = kind_cast<Ccall>(node))
+	{
+		out << "cc " << ccall->c_id;
+		for (auto arg : ccall->arguments)
+			normal_form(out, arg, globals);
+	}
+	out << ')';
 }
-Definition* parse_function(Parser& parser, istream& in)
+static void describe_symbol(ostream& out, Name id)
 {
-	//LOG(parser.token);
-	Var* name = parse_var(parser,in);
-	if (name == nullptr)
-		throw Error(line_number,"expecting varid (1279)");
-	Definition* definition = new Definition();
-	definition->id = name->id;
-	Function* function = new Function();
-	//LOG("after name " << parser.token.text);
-	while (parser.token.text != "=")
+	out << id << ' ';
+	auto i_symbol = symbols.find(id);
+	if (i_symbol == symbols.end())
 	{
-		//LOG(parser.token);
-		Var* arg = parse_var(parser,in);//parse_apat(parser,in);
-		if (arg == nullptr)
-			throw Error(line_number,"expecting varid (1227)");
-		function->arguments.push_back(arg->id);
+		out << '?' << endl;
+		return;
 	}
-	//LOG(parser.token);
-	parser.next(in);
-	//LOG(parser.token);
-	Node* expr = parse_expr(parser, in);
-	if (parser.token.type != TT_SEMI)
-		throw Error(line_number,"semicolon expected");
-	parser.next(in);
-	function->body = expr;
-	definition->defineable = function;
-	//LOG("Defined: " << definition->id);
-	return definition;
+	const Symbol& symbol = i_symbol->second;
+	out << symbol.kind << ' ' << symbol.arity << ' ' << symbol.strict << ' ' << symbol.worker << ' ' << symbol.data;
+	// calls of a selector are compiled as conditionals
+	int test, yes, no;
+	if (symbol.source && selector(symbol.source, test, yes, no))
+		out << " selects " << test << ' ' << yes << ' ' << no;
+	out << endl;
 }
-Definition* parse_definition(Parser& parser, istream& in)
+static string cache_key(const Definition& definition)
 {
-	if (parser.token.type == TT_DATA)
-		return parse_data(parser, in);
-	else
-		return parse_function(parser, in);
+	ostringstream key;
+	key << cache_stamp << endl << profile << definition.imported << endl;
+	set<Name> globals;
+	if (const Type* type = kind_cast<Type>(definition.defineable))
+	{
+		key << "type " << definition.id;
+		for (auto arg : type->arguments)
+			key << ' ' << arg;
+		for (auto& ctor : type->constructors)
+		{
+			key << " | " << ctor.constructor;
+			for (auto arg : ctor.arguments)
+				key << ' ' << arg;
+		}
+		key << endl;
+	}
+	else if (const Function* function = kind_cast<Function>(definition.defineable))
+	{
+		key << "function " << definition.id;
+		for (auto arg : function->arguments)
+			key << ' ' << arg;
+		key << endl;
+		if (function->body && !definition.imported)
+			normal_form(key, function->body, globals);
+		key << endl;
+		describe_symbol(key, definition.id);
+	}
+	for (auto name : globals)
+		describe_symbol(key, name);
+	return key.str();
 }
-typedef list<Definition*> Definitions;
-Definitions parse_definitions(Parser& parser, istream& in)
+static string cache_path(const string& key)
 {
-	Definitions definitions;
-	while (parser.token.type != TT_EOF)
+	// FNV-1a
+	unsigned long long hash = 14695981039346656037ull;
+	for (unsigned char c : key)
+		hash = (hash ^ c) * 1099511628211ull;
+	ostringstream path;
+	path << cache_dir << '/' << hex << setw(16) << setfill('0') << hash;
+	return path.str();
+}
+static void write_field(ostream& out, const string& text)
+{
+	out << text.size() << '\n' << text;
+}
+static bool read_field(istream& in, string& text)
+{
+	size_t size;
+	if (!(in >> size) || in.get() != '\n')
+		return false;
+	text.resize(size);
+	return bool(in.read(&text[0], size));
+}
+static bool cache_read(const string& key, Rendering& rendering)
+{
+	ifstream in(cache_path(key), ios::binary);
+	string stored, count;
+	if (!read_field(in, stored) || stored != key)
+		return false;
+	if (!read_field(in, rendering.prototype) || !read_field(in, rendering.info)
+			|| !read_field(in, rendering.definition) || !read_field(in, count))
+		return false;
+	rendering.literals.resize(stoul(count));
+	for (auto& literal : rendering.literals)
+		if (!read_field(in, literal.key) || !read_field(in, literal.prefix) || !read_field(in, literal.init))
+			return false;
+	return true;
+}
+// Written under a name of its own and renamed into place, so that
+// compilers sharing the cache never see half an entry.
+static void cache_write(const string& key, const Rendering& rendering)
+{
+	string path = cache_path(key);
+	ostringstream temp;
+	temp << path << '.' << getpid() << '.' << this_thread::get_id();
+	ofstream out(temp.str(), ios::binary);
+	write_field(out, key);
+	write_field(out, rendering.prototype);
+	write_field(out, rendering.info);
+	write_field(out, rendering.definition);
+	write_field(out, to_string(rendering.literals.size()));
+	for (auto& literal : rendering.literals)
 	{
-		Definition* definition = parse_definition(parser, in);
-		definitions.push_back(definition);
+		write_field(out, literal.key);
+		write_field(out, literal.prefix);
+		write_field(out, literal.init);
 	}
-
-	return definitions;
+	out.close();
+	if (!out || rename(temp.str().c_str(), path.c_str()) != 0)
+		remove(temp.str().c_str());
 }
-void output_function_prototype(ostream& out, Definition& definition)
+static void render(const Definition& definition, Rendering& rendering)
 {
-	definition.defineable->output_function_prototype(out, definition.id);
+	try {
+		string key;
+		if (cache_dir)
+		{
+			key = cache_key(definition);
+			if ((rendering.cached = cache_read(key, rendering)))
+				return;
+		}
+		definition_line = definition.line;
+		constants = ConstantPool();
+		ostringstream prototype, info, code;
+		definition.defineable->output_function_prototype(prototype, definition.id);
+		if (definition.imported)
+			definition.defineable->output_function_extern(info, definition.id);
+		else
+		{
+			definition.defineable->output_function_info(info, definition.id);
+			definition.defineable->output_function_definition(code, definition.id);
+		}
+		rendering.prototype = prototype.str();
+		rendering.info = info.str();
+		rendering.definition = code.str();
+		rendering.literals = move(constants.literals);
+		if (cache_dir)
+			cache_write(key, rendering);
+	}
+	catch (...) {
+		rendering.error = current_exception();
+	}
 }
-void output_function_info(ostream& out, Definition& definition)
+static vector<Rendering> render_all(const Definitions& definitions)
 {
-	definition.defineable->output_function_info(out, definition.id);
+	vector<const Definition*> order(definitions.begin(), definitions.end());
+	vector<Rendering> renderings(order.size());
+	int threads = jobs > 0 ? jobs : max(1u, thread::hardware_concurrency());
+	threads = min<int>(threads, order.size());
+	size_t next = 0;
+	mutex next_mutex;
+	auto worker = [&]() {
+		for (;;)
+		{
+			size_t i;
+			{
+				lock_guard<mutex> lock(next_mutex);
+				i = next++;
+			}
+			if (i >= order.size())
+				break;
+			render(*order[i], renderings[i]);
+		}
+	};
+	vector<thread> pool;
+	for (int t=1; t<threads; ++t)
+		pool.emplace_back(worker);
+	worker();
+	for (auto& t : pool)
+		t.join();
+	// the error the first failing definition would have raised
+	for (auto& rendering : renderings)
+		if (rendering.error)
+			rethrow_exception(rendering.error);
+	if (cache_dir)
+	{
+		size_t hits = count_if(renderings.begin(), renderings.end(),
+			[](const Rendering& rendering) { return rendering.cached; });
+		cerr << "cache: " << hits << " hits, " << renderings.size() - hits << " misses" << endl;
+	}
+	return renderings;
 }
-void output_function_definition(ostream& out, Definition& definition)
+// The runtime's own supercombinators, then every definition.
+void build_symbols(const Definitions& definitions)
 {
-	definition.defineable->output_function_definition(out, definition.id);
+	for (const char* op : { ">", "<", ">=", "<=", "==", "*", "-", "%", "/", "+", "+#" })
+		symbols[op] = { Symbol::OPERATOR, 2, 3, "fun_" + c_id(op), nullptr, false };
+	symbols["par"] = { Symbol::FUNCTION, 2, 0, "fun_par", nullptr, false };
+	symbols["seq"] = { Symbol::FUNCTION, 2, 1, "fun_seq", nullptr, false };
+	for (auto definition : definitions)
+	{
+		if (Function* function = kind_cast<Function>(definition->defineable))
+			symbols[definition->id] = { Symbol::FUNCTION, int(function->arguments.size()),
+				definition->strict, "fun_" + definition->id, function->body ? function : nullptr,
+				definition->worker, definition->imported };
+		else if (Type* type = kind_cast<Type>(definition->defineable))
+			for (auto& ctor : type->constructors)
+				symbols[ctor.constructor] = { Symbol::CONSTRUCTOR, int(ctor.arguments.size()),
+					0, "ctor_" + c_id(ctor.constructor), nullptr, false };
+	}
+	analyse_strictness();
+	find_data_results();
+	find_workers();
 }
-void output_code(Definitions& definitions)
+void output_code(const Definitions& definitions)
 {
-	// output function prototypes
-	// output info for each function
-	// output function definitions
-	for (auto definition: definitions)
-		output_function_prototype(cout, *definition);
-	for (auto definition: definitions)
-		output_function_info(cout, *definition);
-	for (auto definition: definitions)
-		output_function_definition(cout, *definition);
+	Definitions live;
+	for (auto definition : definitions)
+		if (!definition->unused)
+			live.push_back(definition);
+	build_symbols(live);
+	vector<Rendering> renderings = render_all(live);
+	// function prototypes, the info for each function, the constant pool
+	// the definitions refer to, then the function definitions
+	string functions;
+	for (auto& rendering : renderings)
+		functions += literal_table.link(rendering.literals, rendering.definition);
+	ostringstream head;
+	if (interface_path || !imports.empty())
+		head << "#include \"dcc.h\"" << endl;
+	for (auto& rendering : renderings)
+		head << rendering.prototype;
+	for (auto& rendering : renderings)
+		head << rendering.info;
+	literal_table.output(head);
+	string text = head.str() + functions;
+	cout.write(text.data(), text.size());
+	cout.flush();
 }
 int main(int argc, char** argv)
 {
@@ -1355,36 +4639,70 @@ int main(int argc, char** argv)
 			tokenTest = true;
 		else if (strcmp(argv[i],"--showDefinitions")==0)
 			showDefinitions = true;
+		else if (strcmp(argv[i],"--profile")==0)
+			profile = true;
+		else if (strncmp(argv[i],"--inline=",9)==0)
+			inline_limit = atoi(argv[i]+9);
+		else if (strncmp(argv[i],"--jobs=",7)==0)
+			jobs = atoi(argv[i]+7);
+		else if (strncmp(argv[i],"--interface=",12)==0)
+			interface_path = argv[i]+12;
+		else if (strncmp(argv[i],"--import=",9)==0)
+			imports.push_back(argv[i]+9);
+		else if (strcmp(argv[i],"--keep-unused")==0)
+			keep_unused = true;
+		else if (strncmp(argv[i],"--cache=",8)==0)
+			cache_dir = argv[i]+8;
 		else if (argv[i][0]=='-' && argv[i][1]=='-')
 			continue;
 		else
 			input = argv[i];
 	}
-	std::fstream file;
-	file.open(input, std::ios::binary | std::fstream::in);
-	Parser parser;
-
 	try {
+		if (cache_dir)
+			mkdir(cache_dir, 0777); // or it is there already
+		Source source(input);
+		Parser parser(source);
 		if (tokenTest) {
 			do {
-				parser.next(file);
-				cout << parser.token << endl;
+				parser.next();
+				cout << parser.token << '\n';
 			} while (parser.token.type != TT_EOF);
 		} else {
-			parser.next(file);
-			Definitions definitions = parse_definitions(parser, file);
+			Definitions definitions;
+			for (auto path : imports)
+				read_interface(path, definitions);
+			parser.next();
+			Definitions program = parse_definitions(parser);
+			add_definitions(definitions, program);
+			compile_matches(definitions);
+			if (interface_path)
+				keep_inline_sources(definitions);
+			inline_definitions(definitions);
+			simplify_definitions(definitions);
+			if (!interface_path && !keep_unused)
+				mark_unused(definitions);
 			if (showDefinitions)
+			{
 				for (auto definition : definitions)
-					cout << *definition << endl;
+					if (!definition->imported)
+						cout << *definition << endl;
+				cout << "-- " << inline_count << " calls inlined, "
+					<< simplify_count << " cases simplified" << endl;
+			}
 			output_code(definitions);
+			if (interface_path)
+				write_interface(interface_path, definitions);
 		}
 	}
 	catch (const Error& error)
 	{
 		cout << "Exception " << error.msg << " on line " << error.line << endl;
+		return 1;
 	}
 	catch (const char* exception)
 	{
 		cout << "Exception: "<< exception << endl;
+		return 1;
 	}
 }
@@ -0,0 +1,42 @@
+#!/bin/bash
+# Regression tests. Each program is compiled with the prelude and says in
+# its leading comments what should happen:
+#   -- output: TEXT    the program prints TEXT
+#   -- error: TEXT     dccsuper rejects it with a message containing TEXT
+#   -- absent: TEXT    the generated C does not contain TEXT
+#   -- env: VAR=VALUE  the program runs with VAR set
+# Every failure is reported, and the exit status is 1 if there were any.
+DCCSUPER=${DCCSUPER:-./dccsuper}
+work=$(mktemp -d)
+trap 'rm -rf $work' EXIT
+failed=0
+for prog in ${@:-tests/*.x1}; do
+	fail() { echo "FAIL $prog: $*"; failed=1; }
+	expect() { sed -n "s/^-- $1: //p" $prog; }
+	cat prelude-ctor.x1 $prog > $work/prog.x1
+	$DCCSUPER $work/prog.x1 > $work/prog.c 2> /dev/null
+	status=$?
+	error=$(expect error)
+	if [ -n "$error" ]; then
+		[ $status -ne 0 ] && grep -qF "$error" $work/prog.c || fail "no error '$error'"
+		continue
+	fi
+	if [ $status -ne 0 ]; then
+		fail "$(tail -1 $work/prog.c)"
+		continue
+	fi
+	while read -r absent; do
+		grep -qF "$absent" $work/prog.c && fail "generated C contains '$absent'"
+	done < <(expect absent)
+	output=$(expect output)
+	if [ -n "$output" ]; then
+		cat base.c $work/prog.c > $work/prog.lnk.c
+		if ! gcc -O2 -I. -w -o $work/prog.exe $work/prog.lnk.c; then
+			fail "gcc failed"
+			continue
+		fi
+		actual=$(env $(expect env) $work/prog.exe 2> $work/stderr)
+		[ "$actual" = "$output" ] || fail "printed '$actual', not '$output' $(grep runtime $work/stderr)"
+	fi
+done
+exit $failed